@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+
+"""Reader for villa's shared memory event ring, see src/event_ring.h.
+
+The ring is requested with the event_ring command on a unix domain socket
+connection; the response carries the memfd and the eventfd doorbell.
+"""
+
+import os
+import mmap
+import json
+import struct
+import select
+import socket
+
+EVR_VAD = 1
+EVR_ATOM = 2
+EVR_DTMF = 3
+
+_MAGIC = 0x474e5256
+_HEADER = struct.Struct('<IIII')
+_U32 = struct.Struct('<I')
+_U64 = struct.Struct('<Q')
+_RECORD = struct.Struct('<QQHHiiI96s')
+
+_HEAD = 64
+_TAIL = 128
+_NEED_WAKEUP = 136
+_DROPPED = 192
+_RECORDS = 256
+
+class EventRing(object):
+	def __init__(self, memfd, efd):
+		self.efd = efd
+		size = os.fstat(memfd).st_size
+		self.mm = mmap.mmap(memfd, size)
+		os.close(memfd)
+
+		magic, version, self.record_size, self.capacity = \
+			_HEADER.unpack_from(self.mm, 0)
+		if magic != _MAGIC or self.record_size != _RECORD.size:
+			raise ValueError('not a villa event ring')
+
+	@classmethod
+	def attach(cls, sock, capacity=1024, token='event_ring'):
+		"""Request a ring on a connected unix domain socket (blocking).
+		Events and responses arriving before the ring are discarded."""
+		cmd = { 'type': 'event_ring', 'command': True, 'token': token,
+			'params': [capacity] }
+		data = json.dumps(cmd).encode()
+		if sock.type == socket.SOCK_STREAM:
+			data += b'\r\n'
+		sock.sendall(data)
+
+		while True:
+			msg, fds, flags, addr = socket.recv_fds(sock, 65536, 2)
+			if len(fds) == 2:
+				return cls(fds[0], fds[1])
+			for f in fds:
+				os.close(f)
+
+	def dropped(self):
+		return _U64.unpack_from(self.mm, _DROPPED)[0]
+
+	def poll(self):
+		"""Yield all available records as tuples
+		(seq, tstamp_us, type, call_id, value, value2)."""
+		tail = _U64.unpack_from(self.mm, _TAIL)[0]
+		head = _U64.unpack_from(self.mm, _HEAD)[0]
+
+		while tail < head:
+			offset = _RECORDS + (tail % self.capacity) * self.record_size
+			seq, tstamp, t, id_len, value, value2, _, cid = \
+				_RECORD.unpack_from(self.mm, offset)
+			yield seq, tstamp, t, cid[:id_len].decode(), value, value2
+			tail += 1
+			_U64.pack_into(self.mm, _TAIL, tail)
+
+	def wait(self, timeout=None):
+		"""Arm the doorbell and wait until villa writes more records."""
+		_U32.pack_into(self.mm, _NEED_WAKEUP, 1)
+
+		# re-check to avoid missing records pushed before arming
+		head = _U64.unpack_from(self.mm, _HEAD)[0]
+		if head != _U64.unpack_from(self.mm, _TAIL)[0]:
+			return True
+
+		r, _, _ = select.select([self.efd], [], [], timeout)
+		if r:
+			os.read(self.efd, 8)
+		return bool(r)
+
+	def close(self):
+		self.mm.close()
+		os.close(self.efd)
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+
+"""Measure the command round trip to villa over TCP and unix domain sockets.
+
+Usage: latency.py [-n count] tcp:127.0.0.1:1235 unix:/tmp/villa.sock seqpacket:/tmp/villa.sock
+"""
+
+import sys
+import json
+import time
+import socket
+import argparse
+
+def connect(endpoint):
+	kind, addr = endpoint.split(':', 1)
+	if kind == 'tcp':
+		host, port = addr.rsplit(':', 1)
+		s = socket.create_connection((host, int(port)))
+		s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+	elif kind == 'unix':
+		s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+		s.connect(addr)
+	elif kind == 'seqpacket':
+		s = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+		s.connect(addr)
+	else:
+		raise ValueError(f'unknown transport {kind}')
+
+	return kind, s
+
+class Reader(object):
+	def __init__(self, kind, sock):
+		self.kind = kind
+		self.sock = sock
+		self.buffer = b''
+
+	def frame(self):
+		if self.kind == 'seqpacket':
+			return self.sock.recv(65536)
+
+		while b'\r\n' not in self.buffer:
+			data = self.sock.recv(65536)
+			if not data:
+				raise ConnectionError('connection closed')
+			self.buffer += data
+
+		frame, self.buffer = self.buffer.split(b'\r\n', 1)
+		return frame
+
+def measure(endpoint, count):
+	kind, sock = connect(endpoint)
+	reader = Reader(kind, sock)
+
+	# skip the hello
+	reader.frame()
+
+	samples = []
+	for i in range(count):
+		cmd = json.dumps({ 'type': 'ping', 'command': True,
+			'token': str(i), 'params': [] }).encode()
+		if kind != 'seqpacket':
+			cmd += b'\r\n'
+
+		start = time.perf_counter_ns()
+		sock.sendall(cmd)
+		while not json.loads(reader.frame()).get('response'):
+			pass
+		samples.append(time.perf_counter_ns() - start)
+
+	sock.close()
+	samples.sort()
+
+	def pct(p):
+		return samples[min(len(samples) - 1, int(len(samples) * p))] / 1000.0
+
+	print(f'{endpoint}: n={count} min={samples[0] / 1000.0:.1f}us '
+		f'p50={pct(0.5):.1f}us p99={pct(0.99):.1f}us max={samples[-1] / 1000.0:.1f}us')
+
+if __name__ == '__main__':
+	parser = argparse.ArgumentParser(description='villa command round trip')
+	parser.add_argument('-n', '--count', type=int, default=10000)
+	parser.add_argument('endpoints', nargs='+')
+	args = parser.parse_args()
+
+	for e in args.endpoints:
+		measure(e, args.count)
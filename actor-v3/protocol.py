@@ -32,12 +32,31 @@ class Caller(object):
 		args = molecule.as_args()
 		return self.send_command('enqueue', token, *args)
 
+	def enqueue_after(self, delay, molecule, token=None):
+		"""Enqueue molecule after delay seconds, timed by villa"""
+		args = molecule.as_args()
+		return self.send_command('enqueue_after', token, int(delay * 1000), *args)
+
+	def enqueue_template(self, name, token=None):
+		"""Enqueue a molecule defined with VillaProtocol.define_molecule"""
+		return self.send_command('enqueue_template', token, name)
+
 	def discard(self, token_to_stop):
 		return self.send_command('discard', token_to_stop)
 
 	def discard_range(self, prio_from, prio_to):
 		return self.send_command('discard_range', prio_from, prio_to)
 
+	def discard_tokens(self, *tokens):
+		return self.send_command('discard_tokens', None, *tokens)
+
+	def discard_prefix(self, prefix):
+		return self.send_command('discard_prefix', None, prefix)
+
+	def trace_dump(self, format='json'):
+		"""The last scheduling decisions, 'json' or 'chrome'"""
+		return self.send_command('trace_dump', None, format)
+
 	def call_accepted(self):
 		self.world.enter(self)
 
@@ -74,6 +93,32 @@ class VillaProtocol(asyncio.Protocol):
 		self.send({ 'type': command, 'command' : True,
 				   'token': kwargs.get('token', None), 'params': args })
 
+	def define_molecule(self, name, molecule):
+		"""Store molecule in villa as a template for enqueue_template"""
+		self.send_command('define_molecule', name, *molecule.as_args())
+
+	def preload(self, *paths):
+		"""Warm audio files or globs relative to audio_path in villa"""
+		self.send_command('preload', *paths)
+
+	def log_level(self, *args):
+		"""[subsystem] level, or no arguments to query the levels"""
+		self.send_command('log_level', *args)
+
+	def group_join(self, group, *call_ids):
+		self.send_command('group_join', group, *call_ids)
+
+	def group_leave(self, group, *call_ids):
+		self.send_command('group_leave', group, *call_ids)
+
+	def group_enqueue(self, group, molecule, token=None):
+		"""Enqueue molecule for every caller in group"""
+		self.send_command('group_enqueue', group, *molecule.as_args(),
+			token=token)
+
+	def group_discard(self, group, token_to_stop):
+		self.send_command('group_discard', group, token_to_stop)
+
 	def connection_made(self, transport):
 		logging.info('connected')
 		self.transport = transport
@@ -146,6 +191,8 @@ class VillaProtocol(asyncio.Protocol):
 
 
 async def run(server, port, world, caller_class=Caller):
+	"""Connect to villa via TCP, or via the unix domain socket
+	configured with villa_unix_listen if port is None."""
 	# Get a reference to the event loop as we plan to use
 	# low-level APIs.
 	loop = asyncio.get_running_loop()
@@ -158,14 +205,19 @@ async def run(server, port, world, caller_class=Caller):
 		try:
 			on_con_lost = loop.create_future()
 
-			transport, protocol = await loop.create_connection(
-				lambda: VillaProtocol(on_con_lost, world, caller_class),
-				server, port)
+			if port is None:
+				transport, protocol = await loop.create_unix_connection(
+					lambda: VillaProtocol(on_con_lost, world, caller_class),
+					server)
+			else:
+				transport, protocol = await loop.create_connection(
+					lambda: VillaProtocol(on_con_lost, world, caller_class),
+					server, port)
 
 			timeout = 0.125
 			await on_con_lost
 
-		except ConnectionRefusedError as e:
+		except (ConnectionRefusedError, FileNotFoundError) as e:
 			if transport:
 				transport.close()
 			logging.info(f'connection refused, retrying after {timeout}s')
@@ -0,0 +1,359 @@
+#!/usr/bin/env python3
+
+"""Run several baresip workers with the villa module behind one endpoint.
+
+Each worker is a baresip process with a copy of the configuration, its own
+SIP port and a private unix domain socket for villa. Controllers connect to
+the supervisor as if it were villa: commands for a call go to the worker
+that owns the call, connection commands go to every worker and their
+responses are merged, and the events of all workers form one stream.
+
+Listening on an address from a controller creates a user agent in every
+worker, so each worker registers its own contact for the address.
+
+Usage: supervisor.py [-n workers] [-l 127.0.0.1:1235] [--sip-port 5060] config_dir
+"""
+
+import os
+import json
+import errno
+import shutil
+import asyncio
+import logging
+import argparse
+import itertools
+
+# commands with the call id as their first parameter
+routed = { 'answer', 'hangup', 'resume', 'subscribe_session', 'enqueue',
+	'enqueue_after', 'enqueue_at', 'enqueue_template', 'discard',
+	'discard_range', 'discard_tokens', 'discard_prefix', 'trace_dump' }
+
+# commands with call ids after the group name
+group_members = { 'group_join', 'group_leave' }
+
+# a group may only have members in some of the workers
+any_ok = { 'group_join', 'group_leave', 'group_enqueue', 'group_discard' }
+
+# file descriptors can't be passed through the supervisor
+unsupported = { 'event_ring' }
+
+# How the fields of the workers' responses are merged, per command:
+# 'sum' adds numbers and lists of numbers element by element, 'max' takes
+# the largest, 'concat' joins lists and 'per_worker' lists the values in
+# worker order. Fields without a rule are taken from the first worker
+merge_rules = {
+	'stats': {
+		'sessions': 'sum', 'orphans': 'sum', 'pending_calls': 'sum',
+		'queue_depths': 'sum', 'deferred': 'sum',
+		'commands': 'sum', 'commands_per_sec': 'sum',
+		'events': 'sum', 'events_per_sec': 'sum',
+		'frames_in': 'sum', 'bytes_in': 'sum',
+		'frames_out': 'sum', 'bytes_out': 'sum',
+		'atoms_started': 'sum', 'atoms_failed': 'sum', 'record_bytes': 'sum',
+		'assets': 'per_worker', 'asset_hit_rate': 'per_worker',
+		'prefetched': 'sum', 'prefetch_over_budget': 'sum',
+		'loop_lag_ms': 'max', 'max_loop_lag_ms': 'max',
+		# percentiles can't be combined
+		'latency_us': 'per_worker' },
+	'queue_stats': {
+		'queued': 'sum', 'queued_bytes': 'sum', 'max_queued_bytes': 'max',
+		'dropped': 'sum', 'coalesced': 'sum' },
+	'log_level': { 'levels': 'per_worker', 'dropped': 'sum' },
+	# every worker warms the same files, in parallel
+	'preload': { 'count': 'max', 'missing': 'max', 'bytes': 'max', 'ms': 'max' },
+	'orphans': { 'sessions': 'concat' },
+	'group_enqueue': { 'count': 'sum' },
+	'group_discard': { 'discarded': 'sum' },
+}
+
+def merge_field(rule, values):
+	if rule == 'per_worker':
+		return values
+	if rule == 'concat':
+		return [e for v in values for e in (v or [])]
+	present = [v for v in values if v is not None]
+	if rule == 'max':
+		return max(present)
+	# sum
+	if isinstance(present[0], list):
+		return [sum(column) for column in itertools.zip_longest(*present, fillvalue=0)]
+	return sum(present)
+
+# configuration set per worker
+worker_keys = { 'sip_listen', 'villa_tcp_listen', 'villa_unix_listen',
+	'villa_unix_seqpacket' }
+
+def frame(d):
+	return json.dumps(d).encode() + b'\r\n'
+
+class Worker(object):
+	"""A baresip process with the villa module"""
+	def __init__(self, index, confdir, rundir, sip_address, sip_port):
+		self.index = index
+		self.confdir = os.path.join(rundir, f'worker-{index}')
+		self.path = os.path.join(self.confdir, 'villa.sock')
+		self.process = None
+
+		shutil.copytree(confdir, self.confdir, dirs_exist_ok=True)
+
+		config = os.path.join(self.confdir, 'config')
+		with open(config) as f:
+			lines = [l for l in f if (l.split() or [''])[0] not in worker_keys]
+
+		lines += [
+			f'sip_listen\t\t{sip_address}:{sip_port + index}\n',
+			'villa_tcp_listen\t127.0.0.1:0\n',
+			f'villa_unix_listen\t{self.path}\n' ]
+
+		with open(config, 'w') as f:
+			f.writelines(lines)
+
+	async def start(self, baresip):
+		if os.path.exists(self.path):
+			os.unlink(self.path)
+
+		self.process = await asyncio.create_subprocess_exec(baresip,
+			'-f', self.confdir)
+
+		# wait until villa listens
+		timeout = 0.125
+		while True:
+			try:
+				reader, writer = await asyncio.open_unix_connection(self.path)
+				writer.close()
+				break
+			except (ConnectionRefusedError, FileNotFoundError):
+				if self.process.returncode is not None:
+					raise RuntimeError(f'worker {self.index} exited with {self.process.returncode}')
+				await asyncio.sleep(timeout)
+				timeout = min(timeout * 2, 2.0)
+
+		logging.info(f'worker {self.index} started, pid {self.process.pid}')
+
+	async def stop(self):
+		if self.process and self.process.returncode is None:
+			self.process.terminate()
+			await self.process.wait()
+
+class Pending(object):
+	"""A command forwarded to one or more workers"""
+	def __init__(self, cmd, workers):
+		self.cmd = cmd
+		self.workers = set(workers)
+		self.responses = {}
+
+	def done(self):
+		return self.workers <= self.responses.keys()
+
+class Proxy(object):
+	"""A controller connection and its connections to every worker.
+
+	Villa keeps ownership per connection, so each controller has its own
+	connection to each worker."""
+	def __init__(self, supervisor, reader, writer):
+		self.supervisor = supervisor
+		self.reader = reader
+		self.writer = writer
+		self.workers = []
+		self.pending = {}
+		self.tokens = itertools.count()
+
+	async def run(self):
+		for worker in self.supervisor.workers:
+			r, w = await asyncio.open_unix_connection(worker.path)
+			# the version hello of the worker
+			await r.readuntil(b'\r\n')
+			self.workers.append((r, w))
+
+		self.writer.write(frame({ 'event': True, 'type': 'version',
+			'protocol_version': 1, 'class': 'application' }))
+
+		tasks = [asyncio.create_task(self.from_worker(i, r))
+			for i, (r, _) in enumerate(self.workers)]
+		try:
+			while True:
+				line = await self.reader.readuntil(b'\r\n')
+				if line.strip():
+					self.dispatch(json.loads(line))
+		except (asyncio.IncompleteReadError, ConnectionError):
+			logging.info('controller disconnected')
+		finally:
+			for t in tasks:
+				t.cancel()
+			for _, w in self.workers:
+				w.close()
+			self.writer.close()
+
+	def respond(self, cmd, result, message):
+		r = { 'type': cmd.get('type'), 'class': 'villa', 'response': True,
+			'result': result, 'message': message }
+		if cmd.get('token') is not None:
+			r['token'] = cmd['token']
+		self.writer.write(frame(r))
+
+	def dispatch(self, cmd):
+		t = cmd.get('type')
+		params = cmd.get('params') or []
+		calls = self.supervisor.calls
+		everyone = range(len(self.workers))
+
+		if t in unsupported:
+			return self.respond(cmd, errno.ENOTSUP, 'not supported by the supervisor')
+
+		if t in routed:
+			owner = calls.get(params[0]) if params else None
+			if owner is None:
+				return self.respond(cmd, errno.EINVAL, 'session not found')
+			return self.forward(cmd, { owner: params })
+
+		if t in group_members and params:
+			targets = {}
+			for cid in params[1:]:
+				owner = calls.get(cid)
+				if owner is None:
+					if t == 'group_join':
+						return self.respond(cmd, errno.EINVAL,
+							'call id is not a session of this connection')
+					continue
+				targets.setdefault(owner, params[:1]).append(cid)
+			return self.forward(cmd, targets or { i: params[:1] for i in everyone })
+
+		self.forward(cmd, { i: params for i in everyone })
+
+	def forward(self, cmd, targets):
+		token = f'supervisor-{next(self.tokens)}'
+		self.pending[token] = Pending(cmd, targets.keys())
+
+		for i, params in targets.items():
+			self.workers[i][1].write(frame(dict(cmd, token=token, params=params)))
+
+	async def from_worker(self, index, reader):
+		calls = self.supervisor.calls
+		try:
+			while True:
+				line = await reader.readuntil(b'\r\n')
+				d = json.loads(line)
+
+				if d.get('response'):
+					p = self.pending.get(d.get('token'))
+					if p:
+						p.responses[index] = d
+						self.complete(d['token'])
+						continue
+
+				elif d.get('event'):
+					t = d.get('type')
+					if t == 'call_incoming':
+						calls[d['id']] = index
+					elif t == 'call_closed':
+						calls.pop(d.get('id'), None)
+
+				self.writer.write(line)
+
+		except (asyncio.IncompleteReadError, ConnectionError):
+			logging.warning(f'lost connection to worker {index}')
+
+		# its calls can't be reached anymore
+		for cid in [c for c, i in calls.items() if i == index]:
+			del calls[cid]
+
+		# fail the commands waiting for the worker
+		for token, p in list(self.pending.items()):
+			if index in p.workers and index not in p.responses:
+				p.responses[index] = { 'type': p.cmd.get('type'),
+					'response': True, 'result': errno.ECONNRESET }
+				self.complete(token)
+
+	def complete(self, token):
+		p = self.pending[token]
+		if not p.done():
+			return
+
+		del self.pending[token]
+
+		if p.cmd.get('type') == 'orphans':
+			for index, r in p.responses.items():
+				for s in r.get('sessions', []):
+					self.supervisor.calls[s['id']] = index
+
+		self.writer.write(frame(self.merge(p)))
+
+	def merge(self, p):
+		"""One response from the responses of the workers: failed if one
+		failed (for groups: if all failed), the fields merged by
+		merge_rules"""
+		responses = [p.responses[i] for i in sorted(p.responses)]
+		ok = [r for r in responses if r.get('result', 0) == 0]
+		if p.cmd.get('type') in any_ok and ok:
+			responses = ok
+
+		failed = [r for r in responses if r.get('result', 0) != 0]
+		merged = dict(failed[0] if failed else responses[0])
+
+		if not failed:
+			rules = merge_rules.get(p.cmd.get('type'), {})
+			for k, rule in rules.items():
+				if k in merged:
+					merged[k] = merge_field(rule, [r.get(k) for r in responses])
+
+		merged.pop('token', None)
+		if p.cmd.get('token') is not None:
+			merged['token'] = p.cmd['token']
+
+		return merged
+
+class Supervisor(object):
+	def __init__(self, args):
+		self.args = args
+		self.workers = [Worker(i, args.config, args.rundir, args.sip_address,
+			args.sip_port) for i in range(args.workers)]
+		# call id -> worker index
+		self.calls = {}
+
+	async def connected(self, reader, writer):
+		logging.info('controller connected')
+		await Proxy(self, reader, writer).run()
+
+	async def run(self):
+		try:
+			for w in self.workers:
+				await w.start(self.args.baresip)
+
+			listen = self.args.listen
+			if listen.startswith('unix:'):
+				path = listen[len('unix:'):]
+				if os.path.exists(path):
+					os.unlink(path)
+				server = await asyncio.start_unix_server(self.connected, path)
+			else:
+				host, port = listen.rsplit(':', 1)
+				server = await asyncio.start_server(self.connected, host, int(port))
+
+			logging.info(f'supervisor listening on {self.args.listen}')
+
+			async with server:
+				await server.serve_forever()
+		finally:
+			for w in self.workers:
+				await w.stop()
+
+if __name__ == '__main__':
+	parser = argparse.ArgumentParser(description='villa multi-process supervisor')
+	parser.add_argument('-n', '--workers', type=int, default=os.cpu_count())
+	parser.add_argument('-l', '--listen', default='127.0.0.1:1235',
+		help='host:port or unix:path for controllers')
+	parser.add_argument('--sip-address', default='0.0.0.0')
+	parser.add_argument('--sip-port', type=int, default=5060,
+		help='SIP port of the first worker, the others follow')
+	parser.add_argument('--baresip', default='baresip')
+	parser.add_argument('--rundir', default='/tmp/villa-supervisor',
+		help='where the worker configurations and sockets are created')
+	parser.add_argument('config', help='baresip configuration directory')
+	args = parser.parse_args()
+
+	logging.basicConfig(level=logging.INFO)
+
+	try:
+		asyncio.run(Supervisor(args).run())
+	except KeyboardInterrupt:
+		pass
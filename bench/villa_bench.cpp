@@ -0,0 +1,232 @@
+/**
+ * @file bench/villa_bench.cpp  Microbenchmarks of the molecule queues
+ *
+ * Copyright (C) 2023 Lars Immisch
+ *
+ * The queues run against a fake clock and fake audio devices (see
+ * AudioSeam), so only the queue logic is measured. For machine-readable
+ * results, run with --benchmark_format=json or --benchmark_out=<file>.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include "villa.h"
+
+namespace {
+
+// in ms, advanced by the benchmarks
+uint64_t Now = 1000000;
+// its address stands in for the audio of a call
+int FakeAudio;
+
+uint64_t fake_now() {
+	return Now;
+}
+
+struct audio *fake_call_audio(const struct call *) {
+	return (struct audio*)&FakeAudio;
+}
+
+int fake_set_source(struct audio *, const char *, const char *, size_t) {
+	return 0;
+}
+
+int fake_set_player(struct audio *, const char *, const char *) {
+	return 0;
+}
+
+const char *Files[] = { "bench/a.wav", "bench/b.wav", "bench/c.wav", "bench/d.wav" };
+// the length of every file, in ms
+enum { file_length = 2000 };
+
+// A molecule of n Play atoms
+Molecule *molecule(Session &session, int priority, int mode, size_t n, std::string_view id = {}) {
+
+	Molecule *m = VQueue::alloc();
+	m->_priority = priority;
+	m->_mode = (enum mode)mode;
+	m->_id = id;
+
+	for (size_t i = 0; i < n; ++i) {
+		m->emplace_back<Play>(&session, Files[i % std::size(Files)]);
+	}
+
+	return m;
+}
+
+// A session playing a looping background at priority 5, so molecules at
+// lower priorities only queue up
+struct Busy {
+
+	Busy() : session("bench") {
+		session._queue.enqueue(molecule(session, 5, m_loop | m_pause, 4, "background"));
+	}
+
+	Session session;
+};
+
+void token(char *buf, size_t size, const char *prefix, size_t i) {
+	re_snprintf(buf, size, "%s/%zu", prefix, i);
+}
+
+// Enqueue and discard one molecule behind a queue of the given depth
+void BM_EnqueueDiscard(benchmark::State &state) {
+
+	Busy busy;
+	VQueue &q = busy.session._queue;
+
+	for (int64_t i = 0; i < state.range(0); ++i) {
+		char id[32];
+		token(id, sizeof(id), "queued", i);
+		q.enqueue(molecule(busy.session, 1 + i % 3, 0, 1, id));
+	}
+
+	for (auto _ : state) {
+		Molecule *m = molecule(busy.session, 2, 0, 1, "probe");
+		q.enqueue(m);
+		q.discard(m);
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EnqueueDiscard)->Arg(16)->Arg(256)->Arg(4096);
+
+// A prompt preempts a paused background loop and is discarded while it
+// plays, so the background resumes at its position
+void BM_Preempt(benchmark::State &state) {
+
+	Session session("bench");
+	VQueue &q = session._queue;
+
+	q.enqueue(molecule(session, 0, m_loop | m_pause, state.range(0), "background"));
+
+	for (auto _ : state) {
+		Now += 750;
+		Molecule *m = molecule(session, 3, m_discard, 1, "prompt");
+		q.enqueue(m);
+
+		Now += 250;
+		if (q.discard(m) == VQueue::discard_active) {
+			q.schedule(VQueue::sched_interrupt);
+		}
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Preempt)->Arg(1)->Arg(16)->Arg(256);
+
+// Play a molecule of n atoms to the end, one end of file per atom
+void BM_LongMolecule(benchmark::State &state) {
+
+	Session session("bench");
+	VQueue &q = session._queue;
+	size_t n = state.range(0);
+
+	for (auto _ : state) {
+		q.enqueue(molecule(session, 1, 0, n, "long"));
+
+		for (size_t i = 0; i < n; ++i) {
+			Now += file_length;
+			q.schedule(VQueue::sched_end_of_file);
+		}
+	}
+
+	state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_LongMolecule)->Arg(8)->Arg(64)->Arg(512);
+
+// Seek within a molecule of n atoms
+void BM_SetPosition(benchmark::State &state) {
+
+	Session session("bench");
+	size_t n = state.range(0);
+	Molecule *m = molecule(session, 1, 0, n);
+	size_t length = n * file_length;
+	size_t position = 0;
+
+	for (auto _ : state) {
+		position = (position + 7919) % length;
+		m->set_position(position);
+		benchmark::DoNotOptimize(m->_current);
+	}
+
+	VQueue::release(m);
+}
+BENCHMARK(BM_SetPosition)->Arg(8)->Arg(64)->Arg(512);
+
+// Discard one token of n queued molecules
+void BM_DiscardToken(benchmark::State &state) {
+
+	Busy busy;
+	VQueue &q = busy.session._queue;
+
+	for (int64_t i = 0; i < state.range(0); ++i) {
+		char id[32];
+		token(id, sizeof(id), "queued", i);
+		q.enqueue(molecule(busy.session, 1, 0, 1, id));
+	}
+
+	for (auto _ : state) {
+		q.enqueue(molecule(busy.session, 1, 0, 1, "probe"));
+
+		bool active = false;
+		benchmark::DoNotOptimize(q.discard_token("probe", active));
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DiscardToken)->Arg(16)->Arg(256)->Arg(4096);
+
+// Queue n molecules under a prefix and discard them with one prefix
+void BM_DiscardPrefix(benchmark::State &state) {
+
+	Busy busy;
+	VQueue &q = busy.session._queue;
+	int64_t n = state.range(0);
+
+	for (auto _ : state) {
+		for (int64_t i = 0; i < n; ++i) {
+			char id[32];
+			token(id, sizeof(id), "menu", i);
+			q.enqueue(molecule(busy.session, 1 + i % 3, 0, 1, id));
+		}
+
+		bool active = false;
+		benchmark::DoNotOptimize(q.discard_prefix("menu/", active));
+	}
+
+	state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_DiscardPrefix)->Arg(4)->Arg(64)->Arg(1024);
+
+}
+
+int main(int argc, char **argv) {
+
+	int err = libre_init();
+	if (err) {
+		return 1;
+	}
+
+	Audio = AudioSeam{ fake_now, fake_call_audio, fake_set_source, fake_set_player };
+	PrefetchAtoms = 0;
+	for (int i = 0; i < SLOG_SUBSYSTEMS; ++i) {
+		slog_level_set((slog_sub)i, SLOG_WARN);
+	}
+
+	for (const char *f : Files) {
+		asset(f)->length = file_length;
+	}
+
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+		return 1;
+	}
+
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+
+	libre_close();
+
+	return 0;
+}
@@ -0,0 +1,229 @@
+/**
+ * @file event_ring.c  Shared memory ring for high-rate events
+ *
+ * Copyright (C) 2023 Lars Immisch
+ */
+
+#include <string.h>
+#ifdef __linux__
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#endif
+
+#include <re.h>
+
+#include "event_ring.h"
+#include "slog.h"
+
+#ifdef __linux__
+
+enum {
+	EVR_MAGIC = 0x474e5256,  /* 'VRNG' */
+	EVR_VERSION = 1,
+	EVR_ID_SIZE = 96,
+};
+
+/* producer and consumer indexes live on separate cache lines */
+struct event_ring_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t capacity;
+	uint8_t pad0[48];
+	_Atomic uint64_t head;
+	uint8_t pad1[56];
+	_Atomic uint64_t tail;
+	_Atomic uint32_t need_wakeup;
+	uint8_t pad2[52];
+	_Atomic uint64_t dropped;
+	uint8_t pad3[56];
+};
+
+struct event_record {
+	uint64_t seq;
+	uint64_t tstamp;
+	uint16_t type;
+	uint16_t id_len;
+	int32_t value;
+	int32_t value2;
+	uint32_t reserved;
+	char id[EVR_ID_SIZE];
+};
+
+_Static_assert(sizeof(struct event_ring_hdr) == 256, "ring header size");
+_Static_assert(sizeof(struct event_record) == 128, "ring record size");
+
+struct event_ring {
+	struct event_ring_hdr *hdr;
+	struct event_record *recv;
+	size_t size;
+	uint32_t mask;
+	int memfd;
+	int efd;
+};
+
+static void destructor(void *arg)
+{
+	struct event_ring *er = arg;
+
+	if (er->hdr)
+		(void)munmap(er->hdr, er->size);
+
+	if (er->memfd >= 0)
+		(void)close(er->memfd);
+
+	if (er->efd >= 0)
+		(void)close(er->efd);
+}
+
+int event_ring_alloc(struct event_ring **erp, uint32_t capacity)
+{
+	struct event_ring *er;
+	int err = 0;
+
+	if (!erp || !capacity || capacity > EVR_MAX_CAPACITY ||
+	    (capacity & (capacity - 1)))
+		return EINVAL;
+
+	er = mem_zalloc(sizeof(*er), destructor);
+	if (!er)
+		return ENOMEM;
+
+	er->memfd = -1;
+	er->efd = -1;
+	er->mask = capacity - 1;
+	er->size = sizeof(struct event_ring_hdr) +
+		capacity * sizeof(struct event_record);
+
+	er->memfd = memfd_create("villa-events", MFD_CLOEXEC);
+	if (er->memfd < 0) {
+		err = errno;
+		goto out;
+	}
+
+	if (ftruncate(er->memfd, er->size) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	void *p = mmap(NULL, er->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		er->memfd, 0);
+	if (p == MAP_FAILED) {
+		err = errno;
+		goto out;
+	}
+
+	er->hdr = p;
+	er->recv = (struct event_record *)(er->hdr + 1);
+
+	er->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (er->efd < 0) {
+		err = errno;
+		goto out;
+	}
+
+	er->hdr->magic = EVR_MAGIC;
+	er->hdr->version = EVR_VERSION;
+	er->hdr->record_size = sizeof(struct event_record);
+	er->hdr->capacity = capacity;
+
+ out:
+	if (err)
+		mem_deref(er);
+	else
+		*erp = er;
+
+	return err;
+}
+
+int event_ring_fds(const struct event_ring *er, int fds[2])
+{
+	if (!er || !fds)
+		return EINVAL;
+
+	fds[0] = er->memfd;
+	fds[1] = er->efd;
+
+	return 0;
+}
+
+int event_ring_push(struct event_ring *er, enum event_ring_type type,
+	const char *id, int32_t value, int32_t value2)
+{
+	if (!er)
+		return EINVAL;
+
+	struct event_ring_hdr *hdr = er->hdr;
+
+	uint64_t head = atomic_load_explicit(&hdr->head,
+		memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&hdr->tail,
+		memory_order_acquire);
+
+	if (head - tail > er->mask) {
+		atomic_fetch_add_explicit(&hdr->dropped, 1,
+			memory_order_relaxed);
+		return ENOSPC;
+	}
+
+	struct event_record *r = &er->recv[head & er->mask];
+	size_t len = str_len(id);
+
+	if (len > EVR_ID_SIZE)
+		len = EVR_ID_SIZE;
+
+	r->seq = head;
+	r->tstamp = tmr_jiffies_usec();
+	r->type = (uint16_t)type;
+	r->id_len = (uint16_t)len;
+	r->value = value;
+	r->value2 = value2;
+	r->reserved = 0;
+	memcpy(r->id, id, len);
+
+	atomic_store_explicit(&hdr->head, head + 1, memory_order_release);
+
+	/* only ring the doorbell if the consumer is waiting for it */
+	if (atomic_exchange_explicit(&hdr->need_wakeup, 0,
+			memory_order_acq_rel)) {
+		uint64_t one = 1;
+		if (write(er->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			SLOG(SLOG_VILLA, SLOG_WARN, "event ring doorbell failed (%m)\n", errno);
+	}
+
+	return 0;
+}
+
+#else
+
+int event_ring_alloc(struct event_ring **erp, uint32_t capacity)
+{
+	(void)erp;
+	(void)capacity;
+
+	return ENOTSUP;
+}
+
+int event_ring_fds(const struct event_ring *er, int fds[2])
+{
+	(void)er;
+	(void)fds;
+
+	return ENOTSUP;
+}
+
+int event_ring_push(struct event_ring *er, enum event_ring_type type,
+	const char *id, int32_t value, int32_t value2)
+{
+	(void)er;
+	(void)type;
+	(void)id;
+	(void)value;
+	(void)value2;
+
+	return ENOTSUP;
+}
+
+#endif
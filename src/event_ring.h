@@ -0,0 +1,64 @@
+/**
+ * @file event_ring.h  Shared memory ring for high-rate events
+ *
+ * Copyright (C) 2023 Lars Immisch
+ *
+ * A single producer, single consumer ring of fixed-size event records in a
+ * memfd, with an eventfd as doorbell. villa writes, a local controller
+ * reads. Both file descriptors are passed to the controller with
+ * SCM_RIGHTS in response to the event_ring command.
+ *
+ * Layout of the shared memory (little endian, see actor-v3/event_ring.py):
+ *
+ *   offset  0  u32 magic 'VRNG'
+ *           4  u32 version
+ *           8  u32 record size (128)
+ *          12  u32 capacity (number of records, a power of 2)
+ *          64  u64 head, written by villa
+ *         128  u64 tail, written by the controller
+ *         136  u32 need_wakeup, set by the controller before it sleeps
+ *         192  u64 dropped, records lost because the ring was full
+ *         256  records
+ *
+ * A record at index i (0 <= i < capacity) is valid for sequence numbers
+ * head > seq >= tail with seq % capacity == i:
+ *
+ *           0  u64 seq
+ *           8  u64 timestamp, monotonic usec
+ *          16  u16 type (enum event_ring_type)
+ *          18  u16 length of the call id
+ *          20  i32 value
+ *          24  i32 value2
+ *          28  u32 reserved
+ *          32  char[96] call id, not zero-terminated, truncated
+ */
+
+enum event_ring_type {
+	EVR_VAD = 1,       /* value: 1 voice, 0 silence */
+	EVR_ATOM = 2,      /* value: atom index, value2: offset in ms */
+	EVR_DTMF = 3,      /* value: key, value2: 1 begin, 0 end */
+};
+
+enum {
+	EVR_CAPACITY = 1024,
+	EVR_MAX_CAPACITY = 65536,
+};
+
+struct event_ring;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int event_ring_alloc(struct event_ring **erp, uint32_t capacity);
+
+/* the memfd and the eventfd doorbell, still owned by the ring */
+int event_ring_fds(const struct event_ring *er, int fds[2]);
+
+/* append a record, returns ENOSPC if the consumer doesn't keep up */
+int event_ring_push(struct event_ring *er, enum event_ring_type type,
+	const char *id, int32_t value, int32_t value2);
+
+#ifdef __cplusplus
+}
+#endif
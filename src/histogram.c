@@ -0,0 +1,132 @@
+/**
+ * @file histogram.c  Fixed-bucket latency histograms
+ *
+ * Copyright (C) 2023 Lars Immisch
+ */
+
+#include <string.h>
+#include <re.h>
+
+#include "histogram.h"
+
+#define HIST_MAX ((1ULL << HIST_MAX_BITS) - 1)
+
+
+static unsigned msb(uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return 63 - __builtin_clzll(v);
+#else
+	unsigned bit = 0;
+	while (v >>= 1)
+		++bit;
+	return bit;
+#endif
+}
+
+
+static unsigned bucket(uint64_t v)
+{
+	if (v < HIST_SUB)
+		return (unsigned)v;
+
+	/* keep the top HIST_SUB_BITS bits, the first of which is set */
+	unsigned shift = msb(v) - (HIST_SUB_BITS - 1);
+
+	return HIST_SUB + (shift - 1) * HIST_HALF
+		+ (unsigned)(v >> shift) - HIST_HALF;
+}
+
+
+static uint64_t upper_bound(unsigned i)
+{
+	if (i < HIST_SUB)
+		return i;
+
+	unsigned shift = (i - HIST_SUB) / HIST_HALF + 1;
+	uint64_t top = (i - HIST_SUB) % HIST_HALF + HIST_HALF;
+
+	return ((top + 1) << shift) - 1;
+}
+
+
+void histogram_reset(struct histogram *h)
+{
+	if (!h)
+		return;
+
+	memset(h, 0, sizeof(*h));
+	h->since = tmr_jiffies();
+}
+
+
+void histogram_record(struct histogram *h, uint64_t v)
+{
+	if (!h)
+		return;
+
+	if (v > HIST_MAX)
+		v = HIST_MAX;
+
+	++h->counts[bucket(v)];
+	++h->n;
+	h->sum += v;
+
+	if (v > h->max)
+		h->max = v;
+}
+
+
+void histogram_record_since(struct histogram *h, uint64_t t0)
+{
+	if (!t0)
+		return;
+
+	uint64_t now = tmr_jiffies_usec();
+
+	histogram_record(h, now > t0 ? now - t0 : 0);
+}
+
+
+uint64_t histogram_percentile(const struct histogram *h, double p)
+{
+	if (!h || !h->n)
+		return 0;
+
+	double r = p * (double)h->n;
+	uint64_t rank = (uint64_t)r;
+
+	if ((double)rank < r)
+		++rank;
+	if (!rank)
+		rank = 1;
+
+	uint64_t seen = 0;
+
+	for (unsigned i = 0; i < HIST_BUCKETS; ++i) {
+		seen += h->counts[i];
+		if (seen >= rank) {
+			uint64_t v = upper_bound(i);
+			return v < h->max ? v : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+
+uint64_t histogram_count_le(const struct histogram *h, uint64_t v)
+{
+	if (!h)
+		return 0;
+
+	if (v >= h->max)
+		return h->n;
+
+	uint64_t n = 0;
+
+	for (unsigned i = 0, last = bucket(v); i <= last; ++i)
+		n += h->counts[i];
+
+	return n;
+}
@@ -0,0 +1,50 @@
+/**
+ * @file histogram.h  Fixed-bucket latency histograms
+ *
+ * Copyright (C) 2023 Lars Immisch
+ *
+ * Log-linear buckets after HdrHistogram: values below 32 have a bucket
+ * each, every power of two above has 16 buckets, so a percentile is
+ * never off by more than 6.25%. Recording is a few instructions and
+ * never allocates. Values are in µs and clamped at 2^36 (19 hours).
+ *
+ * A histogram is not thread-safe; record from the thread that owns it.
+ */
+
+enum {
+	HIST_SUB_BITS = 5,
+	HIST_SUB = 1 << HIST_SUB_BITS,
+	HIST_HALF = HIST_SUB / 2,
+	HIST_MAX_BITS = 36,
+	HIST_BUCKETS = HIST_SUB + (HIST_MAX_BITS - HIST_SUB_BITS) * HIST_HALF,
+};
+
+struct histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t n;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t since;  /* tmr_jiffies() of the last reset */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* clear the counts and start a new window */
+void histogram_reset(struct histogram *h);
+void histogram_record(struct histogram *h, uint64_t v);
+
+/* record the µs since t0 (tmr_jiffies_usec), if t0 is set */
+void histogram_record_since(struct histogram *h, uint64_t t0);
+
+/* the upper bound of the bucket that holds the p-quantile, 0 < p <= 1.
+   0 for an empty histogram */
+uint64_t histogram_percentile(const struct histogram *h, double p);
+
+/* the number of values up to the bucket of v, i.e. at most 6.25% above v */
+uint64_t histogram_count_le(const struct histogram *h, uint64_t v);
+
+#ifdef __cplusplus
+}
+#endif
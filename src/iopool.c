@@ -0,0 +1,314 @@
+/**
+ * @file iopool.c  I/O pool: worker threads with lock-free job queues
+ *
+ * Copyright (C) 2023 Lars Immisch
+ */
+
+#include <string.h>
+#include <stdatomic.h>
+#include <re.h>
+
+#include "iopool.h"
+#include "slog.h"
+
+enum {
+	MAX_THREADS = 64,
+};
+
+struct job {
+	_Atomic(struct job *) next;
+	iopool_job_h *h;
+	void *arg;
+};
+
+/* intrusive MPSC queue after Dmitry Vyukov */
+struct jobq {
+	_Atomic(struct job *) head;  /* written by the producers */
+	struct job *tail;            /* owned by the consumer */
+	struct job stub;
+	_Atomic uint32_t pending;
+	struct mqueue *mq;           /* doorbell in the consumer's loop */
+};
+
+struct worker {
+	struct jobq q;
+	thrd_t thread;
+	bool started;
+	mtx_t mtx;
+	cnd_t cnd;
+	bool ready;
+	int err;
+};
+
+struct iopool {
+	struct jobq mainq;
+	struct worker *workers;
+	uint32_t n;
+};
+
+
+static void jobq_init(struct jobq *q)
+{
+	atomic_init(&q->stub.next, NULL);
+	atomic_init(&q->head, &q->stub);
+	q->tail = &q->stub;
+	atomic_init(&q->pending, 0);
+}
+
+
+static void jobq_link(struct jobq *q, struct job *j)
+{
+	atomic_store_explicit(&j->next, NULL, memory_order_relaxed);
+
+	struct job *prev = atomic_exchange_explicit(&q->head, j,
+		memory_order_acq_rel);
+
+	/* until this store, the consumer can't see j or anything after it */
+	atomic_store_explicit(&prev->next, j, memory_order_release);
+}
+
+
+static struct job *jobq_pop(struct jobq *q)
+{
+	struct job *tail = q->tail;
+	struct job *next = atomic_load_explicit(&tail->next,
+		memory_order_acquire);
+
+	if (tail == &q->stub) {
+		if (!next)
+			return NULL;
+
+		q->tail = next;
+		tail = next;
+		next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	}
+
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	/* a producer is between the exchange and the link */
+	if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+		return NULL;
+
+	jobq_link(q, &q->stub);
+
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+
+static int jobq_push(struct jobq *q, iopool_job_h *h, void *arg)
+{
+	struct job *j = mem_zalloc(sizeof(*j), NULL);
+	if (!j)
+		return ENOMEM;
+
+	j->h = h;
+	j->arg = arg;
+
+	jobq_link(q, j);
+
+	/* wake the consumer only when the queue was empty */
+	if (atomic_fetch_add_explicit(&q->pending, 1,
+		memory_order_acq_rel) == 0)
+		return mqueue_push(q->mq, 0, NULL);
+
+	return 0;
+}
+
+
+/* runs in the consumer's loop */
+static void jobq_run(int id, void *data, void *arg)
+{
+	struct jobq *q = arg;
+	uint32_t n = 0;
+	(void)id;
+	(void)data;
+
+	for (;;) {
+		struct job *j = jobq_pop(q);
+		if (j) {
+			j->h(j->arg);
+			mem_deref(j);
+			++n;
+			continue;
+		}
+
+		/* done, unless jobs were pushed meanwhile */
+		if (atomic_fetch_sub_explicit(&q->pending, n,
+			memory_order_acq_rel) == n)
+			return;
+
+		n = 0;
+		thrd_yield();
+	}
+}
+
+
+/* drop the jobs that were never run */
+static void jobq_flush(struct jobq *q)
+{
+	struct job *j;
+
+	while ((j = jobq_pop(q)))
+		mem_deref(j);
+}
+
+
+static int worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	int err = re_thread_init();
+	if (!err)
+		err = mqueue_alloc(&w->q.mq, jobq_run, &w->q);
+
+	mtx_lock(&w->mtx);
+	w->err = err;
+	w->ready = true;
+	cnd_signal(&w->cnd);
+	mtx_unlock(&w->mtx);
+
+	if (err)
+		goto out;
+
+	re_main(NULL);
+
+	w->q.mq = mem_deref(w->q.mq);
+
+ out:
+	re_thread_close();
+
+	return err;
+}
+
+
+static void stop_handler(void *arg)
+{
+	(void)arg;
+
+	re_cancel();
+}
+
+
+static void iopool_destructor(void *arg)
+{
+	struct iopool *sh = arg;
+
+	for (uint32_t i = 0; i < sh->n; ++i) {
+		struct worker *w = &sh->workers[i];
+
+		if (!w->started)
+			continue;
+
+		if (!w->err) {
+			(void)jobq_push(&w->q, stop_handler, NULL);
+			thrd_join(w->thread, NULL);
+		}
+
+		jobq_flush(&w->q);
+		mtx_destroy(&w->mtx);
+		cnd_destroy(&w->cnd);
+	}
+
+	mem_deref(sh->workers);
+
+	sh->mainq.mq = mem_deref(sh->mainq.mq);
+	jobq_flush(&sh->mainq);
+}
+
+
+int iopool_alloc(struct iopool **shp, uint32_t n)
+{
+	struct iopool *sh;
+	int err;
+
+	if (!shp || !n || n > MAX_THREADS)
+		return EINVAL;
+
+	sh = mem_zalloc(sizeof(*sh), iopool_destructor);
+	if (!sh)
+		return ENOMEM;
+
+	jobq_init(&sh->mainq);
+
+	err = mqueue_alloc(&sh->mainq.mq, jobq_run, &sh->mainq);
+	if (err)
+		goto out;
+
+	sh->workers = mem_zalloc(n * sizeof(*sh->workers), NULL);
+	if (!sh->workers) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (uint32_t i = 0; i < n; ++i) {
+		struct worker *w = &sh->workers[i];
+
+		jobq_init(&w->q);
+		mtx_init(&w->mtx, mtx_plain);
+		cnd_init(&w->cnd);
+
+		err = thrd_create(&w->thread, worker_main, w);
+		if (err != thrd_success) {
+			err = EAGAIN;
+			goto out;
+		}
+
+		w->started = true;
+		++sh->n;
+
+		/* the mqueue must exist before jobs are posted */
+		mtx_lock(&w->mtx);
+		while (!w->ready)
+			cnd_wait(&w->cnd, &w->mtx);
+		mtx_unlock(&w->mtx);
+
+		err = w->err;
+		if (err) {
+			thrd_join(w->thread, NULL);
+			goto out;
+		}
+	}
+
+	SLOG(SLOG_VILLA, SLOG_INFO, "I/O pool: %u workers started\n", n);
+
+ out:
+	if (err)
+		mem_deref(sh);
+	else
+		*shp = sh;
+
+	return err;
+}
+
+
+uint32_t iopool_count(const struct iopool *sh)
+{
+	return sh ? sh->n : 0;
+}
+
+
+int iopool_post(struct iopool *sh, uint32_t key, iopool_job_h *h, void *arg)
+{
+	if (!sh || !sh->n || !h)
+		return EINVAL;
+
+	return jobq_push(&sh->workers[key % sh->n].q, h, arg);
+}
+
+
+int iopool_post_main(struct iopool *sh, iopool_job_h *h, void *arg)
+{
+	if (!sh || !h)
+		return EINVAL;
+
+	return jobq_push(&sh->mainq, h, arg);
+}
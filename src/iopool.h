@@ -0,0 +1,36 @@
+/**
+ * @file iopool.h  I/O pool: worker threads with lock-free job queues
+ *
+ * Copyright (C) 2023 Lars Immisch
+ *
+ * The pool runs the blocking work of villa off the main loop: opening and
+ * warming audio files, and rendering metrics. Each worker runs its own re
+ * main loop. Jobs are routed to a worker by key, so the jobs of one key
+ * run in order on the same thread. Results are merged back by posting a
+ * job to the main thread, the thread that allocated the pool.
+ *
+ * The queues are intrusive multi-producer, single-consumer lists. A
+ * producer only wakes the consumer (via an mqueue) when the queue was
+ * empty, so a busy queue costs no system calls.
+ */
+
+struct iopool;
+
+typedef void (iopool_job_h)(void *arg);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int iopool_alloc(struct iopool **shp, uint32_t n);
+uint32_t iopool_count(const struct iopool *sh);
+
+/* run h(arg) on the worker for key, from any thread */
+int iopool_post(struct iopool *sh, uint32_t key, iopool_job_h *h, void *arg);
+
+/* run h(arg) on the main thread, from any thread */
+int iopool_post_main(struct iopool *sh, iopool_job_h *h, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,418 @@
+/**
+ * @file src/json_reader.cpp Streaming JSON reader for command frames
+ *
+ * Copyright (C) 2023 Lars Immisch
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "json_reader.h"
+
+void JsonReader::skip_ws() {
+	while (_pos < _end && (*_pos == ' ' || *_pos == '\t' || *_pos == '\r' || *_pos == '\n')) {
+		++_pos;
+	}
+}
+
+bool JsonReader::at_end() {
+	skip_ws();
+	return _pos == _end;
+}
+
+json_type JsonReader::peek() {
+
+	if (_error) {
+		return j_error;
+	}
+
+	skip_ws();
+	if (_pos == _end) {
+		return j_error;
+	}
+
+	switch (*_pos) {
+		case '{':
+			return j_object;
+		case '[':
+			return j_array;
+		case '}':
+		case ']':
+			return j_end;
+		case '"':
+			return j_string;
+		case 't':
+		case 'f':
+			return j_bool;
+		case 'n':
+			return j_null;
+		case '-':
+			return j_number;
+		default:
+			if (*_pos >= '0' && *_pos <= '9') {
+				return j_number;
+			}
+			return j_error;
+	}
+}
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// Write the escape sequence at _pos (after the backslash) to out as UTF-8
+bool JsonReader::unescape(char *&out) {
+
+	if (_pos >= _end) {
+		return fail();
+	}
+
+	char c = *_pos++;
+	switch (c) {
+		case '"': *out++ = '"'; return true;
+		case '\\': *out++ = '\\'; return true;
+		case '/': *out++ = '/'; return true;
+		case 'b': *out++ = '\b'; return true;
+		case 'f': *out++ = '\f'; return true;
+		case 'n': *out++ = '\n'; return true;
+		case 'r': *out++ = '\r'; return true;
+		case 't': *out++ = '\t'; return true;
+		case 'u':
+			break;
+		default:
+			return fail();
+	}
+
+	auto hex4 = [this](uint32_t &v) {
+		if (_end - _pos < 4) {
+			return false;
+		}
+		v = 0;
+		for (int i = 0; i < 4; ++i) {
+			int h = hex_value(*_pos++);
+			if (h < 0) {
+				return false;
+			}
+			v = (v << 4) | h;
+		}
+		return true;
+	};
+
+	uint32_t cp;
+	if (!hex4(cp)) {
+		return fail();
+	}
+
+	// surrogate pair
+	if (cp >= 0xd800 && cp < 0xdc00) {
+		uint32_t lo;
+		if (_end - _pos < 6 || _pos[0] != '\\' || _pos[1] != 'u') {
+			return fail();
+		}
+		_pos += 2;
+		if (!hex4(lo) || lo < 0xdc00 || lo >= 0xe000) {
+			return fail();
+		}
+		cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+	}
+
+	// the UTF-8 encoding is never longer than the escape sequence
+	if (cp < 0x80) {
+		*out++ = (char)cp;
+	}
+	else if (cp < 0x800) {
+		*out++ = (char)(0xc0 | (cp >> 6));
+		*out++ = (char)(0x80 | (cp & 0x3f));
+	}
+	else if (cp < 0x10000) {
+		*out++ = (char)(0xe0 | (cp >> 12));
+		*out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+		*out++ = (char)(0x80 | (cp & 0x3f));
+	}
+	else {
+		*out++ = (char)(0xf0 | (cp >> 18));
+		*out++ = (char)(0x80 | ((cp >> 12) & 0x3f));
+		*out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+		*out++ = (char)(0x80 | (cp & 0x3f));
+	}
+
+	return true;
+}
+
+bool JsonReader::string(std::string_view &s) {
+
+	if (peek() != j_string) {
+		return fail();
+	}
+
+	char *begin = ++_pos;
+	char *out = begin;
+
+	while (_pos < _end) {
+		char c = *_pos++;
+
+		if (c == '"') {
+			// the closing quote has been consumed, so there is room for the terminator
+			*out = '\0';
+			s = std::string_view(begin, out - begin);
+			return true;
+		}
+
+		if (c == '\\') {
+			if (!unescape(out)) {
+				return false;
+			}
+		}
+		else {
+			*out++ = c;
+		}
+	}
+
+	return fail();
+}
+
+bool JsonReader::string(const char *&s) {
+
+	std::string_view v;
+	if (!string(v)) {
+		return false;
+	}
+
+	s = v.data();
+	return true;
+}
+
+bool JsonReader::number(int64_t &i) {
+
+	if (peek() != j_number) {
+		return fail();
+	}
+
+	char *p = _pos;
+	bool negative = *p == '-';
+	if (negative) {
+		++p;
+	}
+
+	// the magnitude of INT64_MIN fits, too
+	const uint64_t limit = negative ? (uint64_t)INT64_MAX + 1 : INT64_MAX;
+	uint64_t v = 0;
+	bool overflow = false;
+	char *digits = p;
+	while (p < _end && *p >= '0' && *p <= '9') {
+		uint64_t d = *p++ - '0';
+		if (v > (limit - d) / 10) {
+			overflow = true;
+		}
+		v = v * 10 + d;
+	}
+
+	if (p == digits) {
+		return fail();
+	}
+
+	// fractions or exponents, e.g. 2000.0 from the controller
+	if (p < _end && (*p == '.' || *p == 'e' || *p == 'E')) {
+		char *endp = nullptr;
+		double d = strtod(_pos, &endp);
+		// 2^63 is exact as a double, and out of range
+		if (endp == _pos || endp > _end || !(fabs(d) < 9223372036854775808.0)) {
+			return fail();
+		}
+		_pos = endp;
+		i = (int64_t)d;
+		return true;
+	}
+
+	if (overflow) {
+		return fail();
+	}
+
+	_pos = p;
+	i = negative ? (int64_t)(0 - v) : (int64_t)v;
+
+	return true;
+}
+
+bool JsonReader::boolean(bool &b) {
+
+	if (peek() != j_bool) {
+		return fail();
+	}
+
+	if (_end - _pos >= 4 && memcmp(_pos, "true", 4) == 0) {
+		_pos += 4;
+		b = true;
+		return true;
+	}
+
+	if (_end - _pos >= 5 && memcmp(_pos, "false", 5) == 0) {
+		_pos += 5;
+		b = false;
+		return true;
+	}
+
+	return fail();
+}
+
+bool JsonReader::null() {
+
+	if (peek() != j_null || _end - _pos < 4 || memcmp(_pos, "null", 4) != 0) {
+		return fail();
+	}
+
+	_pos += 4;
+	return true;
+}
+
+bool JsonReader::enter(json_type t) {
+
+	if (peek() != t || _depth == JSON_MAX_DEPTH) {
+		return fail();
+	}
+
+	++_pos;
+	++_depth;
+	_first = true;
+	return true;
+}
+
+bool JsonReader::separator(char close) {
+
+	if (_error) {
+		return false;
+	}
+
+	skip_ws();
+	if (_pos >= _end) {
+		return fail();
+	}
+
+	if (*_pos == close) {
+		++_pos;
+		--_depth;
+		// the object or array was a value of its parent
+		_first = false;
+		return false;
+	}
+
+	if (!_first) {
+		if (*_pos != ',') {
+			return fail();
+		}
+		++_pos;
+		skip_ws();
+		if (_pos >= _end || *_pos == close) {
+			return fail();
+		}
+	}
+
+	_first = false;
+	return true;
+}
+
+bool JsonReader::enter_object() {
+	return enter(j_object);
+}
+
+bool JsonReader::key(std::string_view &k) {
+
+	if (!separator('}')) {
+		return false;
+	}
+
+	if (!string(k)) {
+		return false;
+	}
+
+	skip_ws();
+	if (_pos >= _end || *_pos != ':') {
+		return fail();
+	}
+
+	++_pos;
+	return true;
+}
+
+bool JsonReader::enter_array() {
+	return enter(j_array);
+}
+
+bool JsonReader::more() {
+	return separator(']');
+}
+
+// Skip a string without unescaping it, so it can be read again later
+bool JsonReader::skip_string() {
+
+	++_pos;
+	while (_pos < _end) {
+		char c = *_pos++;
+		if (c == '"') {
+			return true;
+		}
+		if (c == '\\') {
+			++_pos;
+		}
+	}
+
+	return fail();
+}
+
+bool JsonReader::skip() {
+
+	switch (peek()) {
+		case j_object:
+			// the depth limit bounds the recursion
+			if (!enter_object()) {
+				return false;
+			}
+			while (separator('}')) {
+				// keys are not unescaped either
+				if (peek() != j_string || !skip_string()) {
+					return fail();
+				}
+
+				skip_ws();
+				if (_pos >= _end || *_pos != ':') {
+					return fail();
+				}
+				++_pos;
+
+				if (!skip()) {
+					return false;
+				}
+			}
+			return !_error;
+		case j_array:
+			if (!enter_array()) {
+				return false;
+			}
+			while (more()) {
+				if (!skip()) {
+					return false;
+				}
+			}
+			return !_error;
+		case j_string:
+			return skip_string();
+		case j_number:
+		{
+			int64_t i;
+			return number(i);
+		}
+		case j_bool:
+		{
+			bool b;
+			return boolean(b);
+		}
+		case j_null:
+			return null();
+		default:
+			return fail();
+	}
+}
@@ -0,0 +1,90 @@
+/**
+ * @file json_reader.h  Streaming JSON reader for command frames
+ *
+ * Copyright (C) 2023 Lars Immisch
+ *
+ * A pull parser over a mutable, zero-terminated frame. Strings are
+ * unescaped and zero-terminated in place, so values can be used directly
+ * as C strings and nothing is allocated while parsing.
+ *
+ * Objects and arrays nest at most JSON_MAX_DEPTH levels deep, deeper
+ * frames fail to parse.
+ */
+
+#ifndef _JSON_READER_H_
+#define _JSON_READER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string_view>
+
+enum {
+	JSON_MAX_DEPTH = 8
+};
+
+enum json_type {
+	j_error,
+	j_end,       // end of the current object or array
+	j_object,
+	j_array,
+	j_string,
+	j_number,
+	j_bool,
+	j_null
+};
+
+class JsonReader {
+
+public:
+
+	JsonReader(char *begin, char *end) : _pos(begin), _end(end) {}
+
+	// the type of the next value
+	json_type peek();
+
+	// consume the next value. Returns false (and sets the error) on a type mismatch
+	bool string(const char *&s);
+	bool string(std::string_view &s);
+	bool number(int64_t &i);  // doubles are truncated, overflows fail
+	bool boolean(bool &b);
+	bool null();
+	// skip the next value without modifying it
+	bool skip();
+
+	// consume '{'. Then call key() until it returns false
+	bool enter_object();
+	// the next key in the current object, false at the end of the object
+	bool key(std::string_view &k);
+
+	// consume '['. Then call more() before every element
+	bool enter_array();
+	// true if another element follows, false at the end of the array
+	bool more();
+
+	bool error() const { return _error; }
+	// true if nothing but whitespace is left
+	bool at_end();
+
+	char *pos() const { return _pos; }
+	char *end() const { return _end; }
+
+protected:
+
+	void skip_ws();
+	bool fail() { _error = true; return false; }
+	bool unescape(char *&out);
+	bool skip_string();
+	bool enter(json_type t);
+	// consume the ',' before the next member or element, or close. False
+	// at the end of the object or array, or on an error
+	bool separator(char close);
+
+	char *_pos;
+	char *_end;
+	bool _error = false;
+	// no member or element of the current object or array was read yet
+	bool _first = false;
+	int _depth = 0;
+};
+
+#endif // _JSON_READER_H_
@@ -6,83 +6,173 @@
 
 #include <math.h>
 #include <string.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
 
 #include <re.h>
 
-#define DEBUG_MODULE "json_tcp"
-#define DEBUG_LEVEL 7
-#include <re_dbg.h>
-
+#include "histogram.h"
+#include "slog.h"
 #include "json_tcp.h"
 
+enum {
+	/* largest frame accepted, without the delimiter */
+	MAX_FRAME = 65536,
+	READ_SIZE = 4096,
+	MAX_FDS = 4,
+	/* bytes handed to libre's TCP send queue before frames wait here */
+	TXQ_LOW = 65536,
+	/* defaults for json_tcp_set_limits */
+	HIGHWATER = 256 * 1024,
+	HARDCAP = 4 * 1024 * 1024,
+	COALESCE_BSIZE = 64,
+};
+
+/* an encoded frame waiting to be sent. mb may be shared, e.g. with a
+   journal, so the frame keeps its own position */
+struct json_frame {
+	struct le le;
+	struct le he;      /* in coalesceh, if it has a key */
+	struct mbuf *mb;
+	size_t pos;        /* the unsent bytes of mb are pos..end */
+	size_t end;
+	char *key;
+	uint64_t t0;       /* the origin of the frame, in µs */
+	int fds[MAX_FDS];  /* passed with SCM_RIGHTS, owned by the frame */
+	int nfds;
+};
+
 struct json_tcp {
+	/* either a TCP connection with a helper... */
 	struct tcp_conn *tc;
 	struct tcp_helper *th;
+	/* ...or a unix domain socket */
+	re_sock_t fd;
+	struct re_fhs *fhs;
+	bool seqpacket;
+	json_tcp_close_h *closeh;
+
+	/* outbound frames that are not yet handed to the socket */
+	struct list sendq;
+	struct hash *coalesceh;
+	tcp_send_h *sendh;
+	bool send_ready;   /* sendh is installed */
+	struct tmr tmr_close;
+	size_t qbytes;
+	size_t highwater;
+	size_t hardcap;
+	bool closing;
+
 	struct mbuf *rcvbuf;
+	uint64_t rx_time;
 	void *arg;
 
 	json_tcp_frame_h *frameh;
 	uint64_t n_tx;
 	uint64_t n_rx;
+	uint64_t bytes_tx;
+	uint64_t bytes_rx;
+	uint64_t n_dropped;
+	uint64_t n_coalesced;
+	size_t max_qbytes;
 };
 
-static bool json_tcp_recv_handler(int *errp, struct mbuf *mbx, bool *estab,
-			      void *arg)
+/* of all connections, since the module was loaded */
+static struct {
+	uint64_t n_tx;
+	uint64_t n_rx;
+	uint64_t bytes_tx;
+	uint64_t bytes_rx;
+} totals;
+
+/* the time from the origin of a frame until it is handed to the socket */
+static struct histogram *wire_latency;
+
+
+static void count_rx(struct json_tcp *jt, size_t bytes)
 {
-	struct json_tcp *jt = arg;
-	(void)estab;
+	jt->rx_time = tmr_jiffies_usec();
+	jt->bytes_rx += bytes;
+	totals.bytes_rx += bytes;
+}
+
+
+static void count_tx(struct json_tcp *jt, size_t bytes)
+{
+	++jt->n_tx;
+	++totals.n_tx;
+	jt->bytes_tx += bytes;
+	totals.bytes_tx += bytes;
+}
+
+/* dispatch a single zero-terminated frame of length l. The frame is
+   decoded by the handler, which may modify it in place. Returns the error
+   the handler set, so no later frame of a failing connection runs */
+static int json_tcp_frame(struct json_tcp *jt, char *frame, size_t l,
+	int *errp)
+{
+	++jt->n_rx;
+	++totals.n_rx;
+
+	if (!l) {
+		SLOG(SLOG_JSON_TCP, SLOG_WARN, "received JSON is empty. Closing connection\n");
+		return EINVAL;
+	}
+
+	SLOG(SLOG_JSON_TCP, SLOG_DEBUG, "received message: %s\n", frame);
+
+	jt->frameh(frame, l, errp, jt->arg);
+
+	return *errp;
+}
+
+/* append stream data and extract all frames delimited by \r\n */
+static int json_tcp_recv(struct json_tcp *jt, const uint8_t *buf, size_t size,
+	int *errp)
+{
+	count_rx(jt, size);
 
 	if (!jt->rcvbuf)
-		jt->rcvbuf = mbuf_alloc(mbx->size);
+		jt->rcvbuf = mbuf_alloc(size);
 
 	struct mbuf *rcvbuf = jt->rcvbuf;
 
-	int err = mbuf_write_mem(rcvbuf, mbuf_buf(mbx), mbuf_get_left(mbx));
+	int err = mbuf_write_mem(rcvbuf, buf, size);
 	if (err) {
-		DEBUG_PRINTF("villa: failed to read into receive buffer (%m). Closing connection\n", err);
-		*errp = ENOMEM;
-		return true;
+		SLOG(SLOG_JSON_TCP, SLOG_ERROR, "failed to read into receive buffer (%m). Closing connection\n", err);
+		return ENOMEM;
 	}
 
 	size_t recv_size = mbuf_end(rcvbuf);
-	const char* recv = (const char*)rcvbuf->buf;
+	char* recv = (char*)rcvbuf->buf;
 
-	/* extract all json frames delimited by \r\n\ in the TCP-stream */
+	/* extract all json frames delimited by \r\n\ in the stream */
 	for (char* rn = strnstr(recv, "\r\n", recv_size); rn; rn = strnstr(recv, "\r\n", recv_size)) {
 
 		size_t l = rn - recv;
+		if (l > MAX_FRAME)
+			break;
 
 		/* zero-terminate the string */
 		*rn = '\0';
 
-		++jt->n_rx;
-
-		struct odict *od = NULL;
-		err = json_decode_odict(&od, DICT_BSIZE, (const char*)recv, l,
-			MAX_LEVELS);
-
-		bool is_empty = odict_count(od, true) == 0;
-		if (err || is_empty) {
-			if (is_empty)
-				DEBUG_PRINTF("villa: received JSON is empty. Closing connection\n", err);
-			else
-				DEBUG_PRINTF("villa: failed to decode JSON (%m). Closing connection\n", err);
-
-			*errp = EINVAL;
-			mem_deref(od);
-			return true;
-		}
-
-		DEBUG_INFO("received message: %s\n", recv);
-
-		jt->frameh(od, errp, jt->arg);
-		mem_deref(od);
+		err = json_tcp_frame(jt, recv, l, errp);
+		if (err)
+			return err;
 
 		l += + 2;
 		recv_size -= l;
 		recv += l;
 	}
 
+	/* the rest is the start of a frame, or a frame that is too large */
+	if (recv_size > MAX_FRAME) {
+		SLOG(SLOG_JSON_TCP, SLOG_WARN, "frame larger than %d bytes. Closing connection\n", MAX_FRAME);
+		return EMSGSIZE;
+	}
+
 	if (recv_size != mbuf_end(rcvbuf)) {
 		mbuf_rewind(jt->rcvbuf);
 		if (recv_size) {
@@ -91,7 +181,18 @@ static bool json_tcp_recv_handler(int *errp, struct mbuf *mbx, bool *estab,
 		}
 	}
 
-	*errp = err;
+	return 0;
+}
+
+static bool json_tcp_recv_handler(int *errp, struct mbuf *mbx, bool *estab,
+			      void *arg)
+{
+	struct json_tcp *jt = arg;
+	(void)estab;
+
+	int err = json_tcp_recv(jt, mbuf_buf(mbx), mbuf_get_left(mbx), errp);
+	if (err)
+		*errp = err;
 
 	/* always handled */
 	return true;
@@ -101,9 +202,24 @@ static void destructor(void *arg)
 {
 	struct json_tcp *jt = arg;
 
+	tmr_cancel(&jt->tmr_close);
+
+	if (jt->send_ready)
+		(void)tcp_set_send(jt->tc, NULL);
+
 	mem_deref(jt->th);
 	mem_deref(jt->tc);
 	mem_deref(jt->rcvbuf);
+
+#ifndef WIN32
+	if (jt->fhs)
+		jt->fhs = fd_close(jt->fhs);
+	if (jt->fd != RE_BAD_SOCK)
+		(void)close(jt->fd);
+#endif
+
+	list_flush(&jt->sendq);
+	mem_deref(jt->coalesceh);
 }
 
 static int json_tcp_print_h(const char *p, size_t size, void *arg)
@@ -113,21 +229,428 @@ static int json_tcp_print_h(const char *p, size_t size, void *arg)
 	return mbuf_write_mem(mb, (const uint8_t*)p, size);
 }
 
-int json_tcp_send(struct json_tcp *jt, struct odict *od)
+static size_t frame_left(const struct json_frame *f)
 {
-	struct mbuf *mb = mbuf_alloc(1024);
+	return f->end - f->pos;
+}
+
+/* the frames of mb end with the stream delimiter. The packet boundary is
+   the frame boundary on SOCK_SEQPACKET */
+static void frame_set(const struct json_tcp *jt, struct json_frame *f,
+	struct mbuf *mb)
+{
+	f->mb = mem_ref(mb);
+	f->pos = mb->pos;
+	f->end = mb->end - (jt->seqpacket ? 2 : 0);
+}
+
+static void frame_destructor(void *arg)
+{
+	struct json_frame *f = arg;
+
+#ifndef WIN32
+	for (int i = 0; i < f->nfds; ++i)
+		(void)close(f->fds[i]);
+#endif
+
+	list_unlink(&f->le);
+	hash_unlink(&f->he);
+	mem_deref(f->mb);
+	mem_deref(f->key);
+}
+
+/* the queued bytes of this connection, including libre's send queue */
+static size_t json_tcp_depth(const struct json_tcp *jt)
+{
+	return jt->qbytes + (jt->tc ? tcp_conn_txqsz(jt->tc) : 0);
+}
+
+static void close_handler(void *arg)
+{
+	struct json_tcp *jt = arg;
+
+	/* the close handler usually destroys jt */
+	if (jt->closeh)
+		jt->closeh(ENOBUFS, jt->arg);
+}
+
+/* close from the main loop, sending is usually called by event handlers */
+static void json_tcp_close(struct json_tcp *jt, int err)
+{
+	if (jt->closing)
+		return;
+
+	SLOG(SLOG_JSON_TCP, SLOG_WARN, "closing connection (%m), %zu bytes queued\n",
+		err, json_tcp_depth(jt));
+
+	jt->closing = true;
+	tmr_start(&jt->tmr_close, 0, close_handler, jt);
+}
+
+#ifndef WIN32
+
+/* send the first chunk of a frame together with its file descriptors */
+static ssize_t send_fds(struct json_tcp *jt, struct json_frame *f)
+{
+	char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+
+	iov.iov_base = f->mb->buf + f->pos;
+	iov.iov_len = frame_left(f);
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * f->nfds);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * f->nfds);
+	memcpy(CMSG_DATA(cmsg), f->fds, sizeof(int) * f->nfds);
+
+	ssize_t n = sendmsg(jt->fd, &msg, MSG_NOSIGNAL);
+	if (n > 0) {
+		/* the peer has its own copies now */
+		for (int i = 0; i < f->nfds; ++i)
+			(void)close(f->fds[i]);
+		f->nfds = 0;
+	}
+
+	return n;
+}
+
+static void fd_handler(int flags, void *arg);
+
+/* write queued frames until the socket would block */
+static int json_tcp_fd_flush(struct json_tcp *jt)
+{
+	struct le *le;
+
+	while ((le = jt->sendq.head)) {
+		struct json_frame *f = le->data;
+		ssize_t n;
+
+		if (f->nfds)
+			n = send_fds(jt, f);
+		else
+			n = send(jt->fd, f->mb->buf + f->pos, frame_left(f),
+				MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			return errno;
+		}
+
+		/* a datagram is sent completely or not at all */
+		if (jt->seqpacket)
+			n = frame_left(f);
+
+		/* partially sent frames can't be coalesced anymore */
+		hash_unlink(&f->he);
+
+		f->pos += n;
+		jt->qbytes -= n;
+
+		if (frame_left(f))
+			break;
+
+		histogram_record_since(wire_latency, f->t0);
+		list_unlink(&f->le);
+		mem_deref(f);
+	}
+
+	int flags = FD_READ | (jt->sendq.head ? FD_WRITE : 0);
+
+	return fd_listen(&jt->fhs, jt->fd, flags, fd_handler, jt);
+}
+
+#endif
+
+/* hand queued frames to the socket */
+static int json_tcp_flush(struct json_tcp *jt)
+{
+#ifndef WIN32
+	if (!jt->tc)
+		return json_tcp_fd_flush(jt);
+#endif
+
+	/* keep frames here while libre's queue is full, so they can be
+	   coalesced or dropped */
+	struct le *le;
+	while ((le = jt->sendq.head) && tcp_conn_txqsz(jt->tc) < TXQ_LOW) {
+		struct json_frame *f = le->data;
+		size_t len = frame_left(f);
+
+		/* the whole of mb, frame_set doesn't trim on TCP */
+		int err = tcp_send(jt->tc, f->mb);
+		jt->qbytes -= len;
+		if (!err)
+			histogram_record_since(wire_latency, f->t0);
+		list_unlink(&f->le);
+		mem_deref(f);
+		if (err)
+			return err;
+	}
+
+	/* libre calls sendh when its queue is empty. While it is installed,
+	   the socket is polled for writing, so only while frames wait */
+	bool ready = jt->sendq.head != NULL;
+	if (ready != jt->send_ready) {
+		int err = tcp_set_send(jt->tc, ready ? jt->sendh : NULL);
+		if (err)
+			return err;
+
+		jt->send_ready = ready;
+	}
+
+	return 0;
+}
+
+static bool coalesce_cmp(struct le *le, void *arg)
+{
+	const struct json_frame *f = le->data;
+
+	return 0 == str_cmp(f->key, arg);
+}
+
+/* mb is a frame from json_tcp_encode. It is queued by reference and
+   not modified: tcp_send restores its position */
+static int json_tcp_enqueue(struct json_tcp *jt, struct mbuf *mb,
+	enum json_tcp_class cls, const char *key, const int *fds, int nfds,
+	uint64_t t0)
+{
+	size_t len = mbuf_get_left(mb) - (jt->seqpacket ? 2 : 0);
+	size_t depth = json_tcp_depth(jt);
+	int err = 0;
+
+	if (jt->closing)
+		return ENOTCONN;
+
+	if (cls == JSON_TCP_COALESCE && key && jt->coalesceh) {
+		struct le *le = hash_lookup(jt->coalesceh, hash_joaat_str(key),
+			coalesce_cmp, (void *)key);
+		if (le) {
+			/* keep the position of the queued frame, but send only
+			   the latest state */
+			struct json_frame *f = le->data;
+
+			jt->qbytes -= frame_left(f);
+			mem_deref(f->mb);
+			frame_set(jt, f, mb);
+			f->t0 = t0;
+			jt->qbytes += len;
+			++jt->n_coalesced;
+
+			return 0;
+		}
+	}
+	else if (cls == JSON_TCP_DROPPABLE && depth > jt->highwater) {
+		++jt->n_dropped;
+		return 0;
+	}
+
+	if (depth + len > jt->hardcap) {
+		json_tcp_close(jt, ENOBUFS);
+		return ENOBUFS;
+	}
+
+	count_tx(jt, len);
+
+	/* fast path */
+	if (jt->tc && !jt->sendq.head && !nfds &&
+	    tcp_conn_txqsz(jt->tc) < TXQ_LOW) {
+		err = tcp_send(jt->tc, mb);
+		if (!err)
+			histogram_record_since(wire_latency, t0);
+		return err;
+	}
+
+	if (jt->tc && nfds)
+		return ENOTSUP;
+
+	struct json_frame *f = mem_zalloc(sizeof(*f), frame_destructor);
+	if (!f)
+		return ENOMEM;
+
+	frame_set(jt, f, mb);
+	f->t0 = t0;
+
+#ifndef WIN32
+	for (int i = 0; i < nfds; ++i) {
+		f->fds[i] = dup(fds[i]);
+		if (f->fds[i] < 0) {
+			err = errno;
+			mem_deref(f);
+			return err;
+		}
+		f->nfds = i + 1;
+	}
+#else
+	(void)fds;
+#endif
+
+	if (cls == JSON_TCP_COALESCE && key) {
+		if (!jt->coalesceh)
+			err = hash_alloc(&jt->coalesceh, COALESCE_BSIZE);
+
+		if (!err)
+			err = str_dup(&f->key, key);
+
+		if (err) {
+			mem_deref(f);
+			return err;
+		}
+
+		hash_append(jt->coalesceh, hash_joaat_str(key), &f->he, f);
+	}
 
+	list_append(&jt->sendq, &f->le, f);
+	jt->qbytes += len;
+
+	depth += len;
+	if (depth > jt->max_qbytes)
+		jt->max_qbytes = depth;
+
+	/* otherwise, wait until the socket is writable */
+	if (jt->sendq.head != &f->le)
+		return 0;
+
+	err = json_tcp_flush(jt);
+	if (err)
+		json_tcp_close(jt, err);
+
+	return err;
+}
+
+#ifndef WIN32
+
+static void fd_handler(int flags, void *arg)
+{
+	struct json_tcp *jt = arg;
+	int err = 0;
+
+	if (flags & FD_WRITE) {
+		err = json_tcp_fd_flush(jt);
+		if (err)
+			goto out;
+	}
+
+	if (!(flags & FD_READ))
+		return;
+
+	if (jt->seqpacket) {
+		/* the packet boundary is the frame boundary */
+		if (!jt->rcvbuf)
+			jt->rcvbuf = mbuf_alloc(MAX_FRAME + 1);
+
+		if (!jt->rcvbuf) {
+			err = ENOMEM;
+			goto out;
+		}
+
+		char *frame = (char *)jt->rcvbuf->buf;
+		ssize_t n = recv(jt->fd, frame, MAX_FRAME + 1, MSG_TRUNC);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			err = errno;
+			goto out;
+		}
+
+		if (n == 0) {
+			err = ECONNRESET;
+			goto out;
+		}
+
+		if (n > MAX_FRAME) {
+			SLOG(SLOG_JSON_TCP, SLOG_WARN, "frame of %zd bytes too large. Closing connection\n", n);
+			err = EMSGSIZE;
+			goto out;
+		}
+
+		count_rx(jt, n);
+
+		/* tolerate the stream delimiter */
+		if (n >= 2 && frame[n - 2] == '\r' && frame[n - 1] == '\n')
+			n -= 2;
+
+		frame[n] = '\0';
+
+		int ferr = 0;
+		err = json_tcp_frame(jt, frame, n, &ferr);
+		if (!err)
+			err = ferr;
+	}
+	else {
+		uint8_t buf[READ_SIZE];
+
+		ssize_t n = recv(jt->fd, buf, sizeof(buf), 0);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			err = errno;
+			goto out;
+		}
+
+		if (n == 0) {
+			err = ECONNRESET;
+			goto out;
+		}
+
+		int ferr = 0;
+		err = json_tcp_recv(jt, buf, n, &ferr);
+		if (!err)
+			err = ferr;
+	}
+
+ out:
+	if (err) {
+		jt->fhs = fd_close(jt->fhs);
+
+		/* the close handler usually destroys jt */
+		if (jt->closeh)
+			jt->closeh(err, jt->arg);
+	}
+}
+
+#endif
+
+int json_tcp_encode(struct mbuf *mb, const struct odict *od)
+{
 	struct re_printf pf = { json_tcp_print_h, mb };
 
+	if (!mb || !od)
+		return EINVAL;
+
+	size_t start = mb->pos;
+
 	int err = json_encode_odict(&pf, od);
+	if (!err)
+		err = mbuf_write_str(mb, "\r\n");
+
+	mb->pos = start;
+
+	return err;
+}
+
+static int json_tcp_send_priv(struct json_tcp *jt, struct odict *od,
+	enum json_tcp_class cls, const char *key, const int *fds, int nfds)
+{
+	struct mbuf *mb = mbuf_alloc(1024);
+
+	int err = json_tcp_encode(mb, od);
 	if (err) {
 		goto out;
 	}
 
-	mbuf_write_str(mb, "\r\n");
-
-	mbuf_set_pos(mb, 0);
-	err = tcp_send(jt->tc, mb);
+	err = json_tcp_enqueue(jt, mb, cls, key, fds, nfds, 0);
 
 out:
 	mem_deref(mb);
@@ -136,6 +659,100 @@ out:
 	return err;
 }
 
+int json_tcp_send(struct json_tcp *jt, struct odict *od)
+{
+	return json_tcp_send_priv(jt, od, JSON_TCP_CRITICAL, NULL, NULL, 0);
+}
+
+int json_tcp_send_event(struct json_tcp *jt, struct odict *od,
+	enum json_tcp_class cls, const char *key)
+{
+	return json_tcp_send_priv(jt, od, cls, key, NULL, 0);
+}
+
+int json_tcp_send_encoded(struct json_tcp *jt, const struct mbuf *json,
+	enum json_tcp_class cls, const char *key, uint64_t t0)
+{
+	if (!jt || !json || mbuf_get_left(json) < 2)
+		return EINVAL;
+
+	/* queued by reference, see json_tcp_enqueue */
+	return json_tcp_enqueue(jt, (struct mbuf *)json, cls, key, NULL, 0,
+		t0);
+}
+
+int json_tcp_send_fds(struct json_tcp *jt, struct odict *od,
+	const int *fds, int nfds)
+{
+	if (nfds < 0 || nfds > MAX_FDS) {
+		mem_deref(od);
+		return EINVAL;
+	}
+
+	return json_tcp_send_priv(jt, od, JSON_TCP_CRITICAL, NULL, fds, nfds);
+}
+
+void json_tcp_set_limits(struct json_tcp *jt, size_t highwater,
+	size_t hardcap)
+{
+	if (!jt)
+		return;
+
+	if (highwater)
+		jt->highwater = highwater;
+
+	if (hardcap)
+		jt->hardcap = hardcap;
+}
+
+void json_tcp_stats(const struct json_tcp *jt, struct json_tcp_stats *st)
+{
+	if (!jt || !st)
+		return;
+
+	st->n_rx = jt->n_rx;
+	st->n_tx = jt->n_tx;
+	st->bytes_rx = jt->bytes_rx;
+	st->bytes_tx = jt->bytes_tx;
+	st->queued = list_count(&jt->sendq);
+	st->queued_bytes = json_tcp_depth(jt);
+	st->max_queued_bytes = jt->max_qbytes;
+	st->n_dropped = jt->n_dropped;
+	st->n_coalesced = jt->n_coalesced;
+}
+
+void json_tcp_send_ready(struct json_tcp *jt)
+{
+	if (!jt || !jt->tc)
+		return;
+
+	int err = json_tcp_flush(jt);
+	if (err)
+		json_tcp_close(jt, err);
+}
+
+uint64_t json_tcp_rx_time(const struct json_tcp *jt)
+{
+	return jt ? jt->rx_time : 0;
+}
+
+void json_tcp_set_latency(struct histogram *h)
+{
+	wire_latency = h;
+}
+
+void json_tcp_totals(struct json_tcp_stats *st)
+{
+	if (!st)
+		return;
+
+	memset(st, 0, sizeof(*st));
+	st->n_rx = totals.n_rx;
+	st->n_tx = totals.n_tx;
+	st->bytes_rx = totals.bytes_rx;
+	st->bytes_tx = totals.bytes_tx;
+}
+
 static struct odict *json_tcp_hello(void)
 {
 	struct odict *od = NULL;
@@ -152,19 +769,29 @@ static struct odict *json_tcp_hello(void)
 }
 
 
+static void json_tcp_init(struct json_tcp *jt)
+{
+	jt->fd = RE_BAD_SOCK;
+	jt->highwater = HIGHWATER;
+	jt->hardcap = HARDCAP;
+	tmr_init(&jt->tmr_close);
+}
+
 int json_tcp_insert(struct json_tcp **jtp, struct tcp_conn *tc,
-		int layer, json_tcp_frame_h *frameh, void *arg)
+		int layer, json_tcp_frame_h *frameh, tcp_send_h *sendh,
+		json_tcp_close_h *closeh, void *arg)
 {
 	struct json_tcp *jt;
 	int err;
 
-	if (!jtp || !tc || !frameh)
+	if (!jtp || !tc || !frameh || !sendh)
 		return EINVAL;
 
 	jt = mem_zalloc(sizeof(*jt), destructor);
 	if (!jt)
 		return ENOMEM;
 
+	json_tcp_init(jt);
 	jt->tc = mem_ref(tc);
 	err = tcp_register_helper(&jt->th, tc, layer, NULL,
 				  NULL, json_tcp_recv_handler, jt);
@@ -172,6 +799,8 @@ int json_tcp_insert(struct json_tcp **jtp, struct tcp_conn *tc,
 		goto out;
 
 	jt->frameh = frameh;
+	jt->sendh = sendh;
+	jt->closeh = closeh;
 	jt->arg = arg;
 	jt->rcvbuf = NULL;
 
@@ -187,3 +816,50 @@ int json_tcp_insert(struct json_tcp **jtp, struct tcp_conn *tc,
 
 	return err;
 }
+
+
+#ifndef WIN32
+int json_tcp_insert_fd(struct json_tcp **jtp, re_sock_t fd, bool seqpacket,
+		json_tcp_frame_h *frameh, json_tcp_close_h *closeh, void *arg)
+{
+	struct json_tcp *jt;
+	int err;
+
+	if (!jtp || fd == RE_BAD_SOCK || !frameh)
+		return EINVAL;
+
+	jt = mem_zalloc(sizeof(*jt), destructor);
+	if (!jt)
+		return ENOMEM;
+
+	json_tcp_init(jt);
+	jt->fd = fd;
+	jt->seqpacket = seqpacket;
+	jt->frameh = frameh;
+	jt->closeh = closeh;
+	jt->arg = arg;
+
+	err = net_sockopt_blocking_set(fd, false);
+	if (err)
+		goto out;
+
+	err = fd_listen(&jt->fhs, fd, FD_READ, fd_handler, jt);
+	if (err)
+		goto out;
+
+	/* send hello with protocol version */
+	struct odict* hello = json_tcp_hello();
+	err = json_tcp_send(jt, hello);
+
+ out:
+	if (err) {
+		/* the caller keeps ownership of fd on error */
+		jt->fd = RE_BAD_SOCK;
+		mem_deref(jt);
+	}
+	else
+		*jtp = jt;
+
+	return err;
+}
+#endif
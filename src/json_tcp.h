@@ -6,12 +6,36 @@
 
 enum {
 	DICT_BSIZE = 32,
-	MAX_LEVELS =  8,
 };
 
 struct json_tcp;
+struct histogram;
 
-typedef bool (json_tcp_frame_h)(const struct odict *od, int *errp, void *arg);
+/* What to do with an outbound frame when the peer doesn't keep up */
+enum json_tcp_class {
+	JSON_TCP_CRITICAL,   /* never dropped, e.g. responses, call_closed */
+	JSON_TCP_DROPPABLE,  /* dropped above the high-water mark */
+	JSON_TCP_COALESCE,   /* replaces a queued frame with the same key */
+};
+
+struct json_tcp_stats {
+	uint64_t n_rx;            /* frames */
+	uint64_t n_tx;
+	uint64_t bytes_rx;
+	uint64_t bytes_tx;
+	size_t queued;            /* frames waiting in json_tcp */
+	size_t queued_bytes;      /* including the TCP send queue */
+	size_t max_queued_bytes;
+	uint64_t n_dropped;
+	uint64_t n_coalesced;
+};
+
+/* called with a zero-terminated JSON frame, which the handler may modify */
+typedef bool (json_tcp_frame_h)(char *frame, size_t len, int *errp, void *arg);
+
+/* called when a unix domain socket connection is closed or fails, or
+   when the outbound queue exceeds the hard cap */
+typedef void (json_tcp_close_h)(int err, void *arg);
 
 #ifdef __cplusplus
 extern "C" {
@@ -20,8 +44,62 @@ extern "C" {
 /* send the dict od as json, terminated by \r\n. od will be destroyed when sent */
 int json_tcp_send(struct json_tcp *json_tcp, struct odict *od);
 
+/* send an event frame with the given backpressure class. key identifies
+   state events for JSON_TCP_COALESCE, e.g. "vad:<call id>" */
+int json_tcp_send_event(struct json_tcp *json_tcp, struct odict *od,
+	enum json_tcp_class cls, const char *key);
+
+/* encode od as a json frame into mb, terminated by \r\n. The position
+   of mb stays at the start of the frame */
+int json_tcp_encode(struct mbuf *mb, const struct odict *od);
+
+/* send a frame encoded by json_tcp_encode. json is queued by reference
+   and not modified, so it can be sent again, e.g. from a journal. t0 is
+   the origin of the frame (tmr_jiffies_usec) for the latency histogram,
+   or 0 */
+int json_tcp_send_encoded(struct json_tcp *json_tcp, const struct mbuf *json,
+	enum json_tcp_class cls, const char *key, uint64_t t0);
+
+/* like json_tcp_send, and pass (duplicates of) the file descriptors fds
+   with SCM_RIGHTS. Fails with ENOTSUP on TCP connections */
+int json_tcp_send_fds(struct json_tcp *json_tcp, struct odict *od,
+	const int *fds, int nfds);
+
+/* sendh is installed with tcp_set_send while frames wait for libre's
+   send queue. It gets the arg of tcp_accept and must call
+   json_tcp_send_ready */
 int json_tcp_insert(struct json_tcp **json_tcpp, struct tcp_conn *tc,
-		int layer, json_tcp_frame_h *frameh, void *arg);
+		int layer, json_tcp_frame_h *frameh, tcp_send_h *sendh,
+		json_tcp_close_h *closeh, void *arg);
+
+/* hand the waiting frames to the TCP connection */
+void json_tcp_send_ready(struct json_tcp *json_tcp);
+
+/* droppable frames are discarded above highwater bytes, the connection
+   is closed above hardcap bytes. 0 keeps the current value */
+void json_tcp_set_limits(struct json_tcp *json_tcp, size_t highwater,
+	size_t hardcap);
+
+void json_tcp_stats(const struct json_tcp *json_tcp,
+	struct json_tcp_stats *stats);
+
+/* the frames and bytes of all connections, the queue fields are 0 */
+void json_tcp_totals(struct json_tcp_stats *stats);
+
+/* when the data of the frame being dispatched was read (tmr_jiffies_usec) */
+uint64_t json_tcp_rx_time(const struct json_tcp *json_tcp);
+
+/* record the time from t0 of a frame until it is handed to the socket
+   in h, or stop recording if h is NULL */
+void json_tcp_set_latency(struct histogram *h);
+
+#ifndef WIN32
+/* use the connected unix domain socket fd with the same framing. On
+   SOCK_SEQPACKET sockets, each packet is one frame. Takes ownership of fd */
+int json_tcp_insert_fd(struct json_tcp **json_tcpp, re_sock_t fd,
+		bool seqpacket, json_tcp_frame_h *frameh,
+		json_tcp_close_h *closeh, void *arg);
+#endif
 
 #ifdef __cplusplus
 }
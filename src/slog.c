@@ -0,0 +1,350 @@
+/**
+ * @file slog.c  Asynchronous structured logging
+ *
+ * Copyright (C) 2023 Lars Immisch
+ */
+
+#include <string.h>
+#include <stdatomic.h>
+#include <re.h>
+#include <baresip.h>
+
+#include "slog.h"
+
+enum {
+	MSG_SIZE = 232,
+	MIN_RING = 64,
+};
+
+/* a slot of the ring. seq is the position the slot is free for, or that
+   position + 1 when the entry is written */
+struct entry {
+	_Atomic uint64_t seq;
+	uint64_t time;     /* tmr_jiffies_rt_usec() */
+	uint8_t sub;
+	uint8_t level;
+	char msg[MSG_SIZE];
+};
+
+_Atomic uint8_t slog_levels[SLOG_SUBSYSTEMS] = {
+	SLOG_INFO, SLOG_INFO, SLOG_INFO, SLOG_INFO
+};
+
+static const char *level_names[] = {
+	"off", "error", "warn", "info", "debug"
+};
+
+static const char *sub_names[SLOG_SUBSYSTEMS] = {
+	"villa", "sched", "call", "json_tcp"
+};
+
+static const enum log_level log_levels[] = {
+	LEVEL_DEBUG, LEVEL_ERROR, LEVEL_WARN, LEVEL_INFO, LEVEL_DEBUG
+};
+
+/* bounded multi-producer ring after Dmitry Vyukov */
+static struct {
+	struct entry *ring;
+	uint64_t mask;
+	_Atomic uint64_t head;  /* claimed by the producers */
+	uint64_t tail;          /* owned by the writer */
+	_Atomic uint64_t dropped;
+	_Atomic bool run;
+	/* the writer waits for entries, producers signal it */
+	_Atomic bool sleeping;
+	mtx_t mtx;
+	cnd_t cnd;
+	thrd_t thread;
+} lg;
+
+
+/* one logfmt line, the message quoted. baresip's log formats into a
+   buffer of its own, so the writer thread may call it */
+static void print_line(uint64_t time, uint8_t sub, uint8_t level,
+	const char *msg)
+{
+	char line[2 * MSG_SIZE + 96];
+	size_t n;
+
+	int l = re_snprintf(line, sizeof(line),
+		"ts=%llu.%06llu level=%s sub=%s msg=\"",
+		(unsigned long long)(time / 1000000),
+		(unsigned long long)(time % 1000000),
+		level_names[level], sub_names[sub]);
+	if (l < 0)
+		return;
+
+	n = l;
+
+	for (const char *p = msg; *p && n < sizeof(line) - 4; ++p) {
+		switch (*p) {
+
+		case '"':
+		case '\\':
+			line[n++] = '\\';
+			line[n++] = *p;
+			break;
+
+		case '\n':
+			/* messages end with one */
+			if (p[1]) {
+				line[n++] = '\\';
+				line[n++] = 'n';
+			}
+			break;
+
+		default:
+			line[n++] = *p;
+			break;
+		}
+	}
+
+	line[n++] = '"';
+	line[n++] = '\n';
+	line[n] = '\0';
+
+	loglv(log_levels[level], "%s", line);
+}
+
+
+static uint32_t drain(void)
+{
+	uint32_t n = 0;
+
+	for (;;) {
+		struct entry *e = &lg.ring[lg.tail & lg.mask];
+
+		if (atomic_load_explicit(&e->seq, memory_order_acquire)
+		    != lg.tail + 1)
+			break;
+
+		print_line(e->time, e->sub, e->level, e->msg);
+
+		/* free for the producers of the next round */
+		atomic_store_explicit(&e->seq, lg.tail + lg.mask + 1,
+			memory_order_release);
+		++lg.tail;
+		++n;
+	}
+
+	return n;
+}
+
+
+static bool ready(void)
+{
+	struct entry *e = &lg.ring[lg.tail & lg.mask];
+
+	return atomic_load_explicit(&e->seq, memory_order_acquire)
+		== lg.tail + 1;
+}
+
+
+static void wake(void)
+{
+	mtx_lock(&lg.mtx);
+	cnd_signal(&lg.cnd);
+	mtx_unlock(&lg.mtx);
+}
+
+
+static int writer_main(void *arg)
+{
+	(void)arg;
+
+	while (atomic_load_explicit(&lg.run, memory_order_acquire)) {
+		if (drain())
+			continue;
+
+		mtx_lock(&lg.mtx);
+
+		/* pairs with the fence in slog_write: either the producer
+		   sees sleeping, or we see its entry */
+		atomic_store_explicit(&lg.sleeping, true,
+			memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		if (!ready() &&
+		    atomic_load_explicit(&lg.run, memory_order_acquire))
+			cnd_wait(&lg.cnd, &lg.mtx);
+
+		atomic_store_explicit(&lg.sleeping, false,
+			memory_order_relaxed);
+		mtx_unlock(&lg.mtx);
+	}
+
+	(void)drain();
+
+	return 0;
+}
+
+
+int slog_init(uint32_t size)
+{
+	uint64_t n = MIN_RING;
+
+	if (lg.ring)
+		return EALREADY;
+
+	while (n < size)
+		n <<= 1;
+
+	struct entry *ring = mem_zalloc(n * sizeof(*ring), NULL);
+	if (!ring)
+		return ENOMEM;
+
+	for (uint64_t i = 0; i < n; ++i)
+		atomic_init(&ring[i].seq, i);
+
+	lg.mask = n - 1;
+	lg.tail = 0;
+	atomic_init(&lg.head, 0);
+	atomic_init(&lg.dropped, 0);
+	atomic_init(&lg.run, true);
+	atomic_init(&lg.sleeping, false);
+	mtx_init(&lg.mtx, mtx_plain);
+	cnd_init(&lg.cnd);
+	lg.ring = ring;
+
+	if (thrd_create(&lg.thread, writer_main, NULL) != thrd_success) {
+		lg.ring = mem_deref(ring);
+		cnd_destroy(&lg.cnd);
+		mtx_destroy(&lg.mtx);
+		return EAGAIN;
+	}
+
+	return 0;
+}
+
+
+void slog_close(void)
+{
+	if (!lg.ring)
+		return;
+
+	atomic_store_explicit(&lg.run, false, memory_order_release);
+	wake();
+	thrd_join(lg.thread, NULL);
+
+	cnd_destroy(&lg.cnd);
+	mtx_destroy(&lg.mtx);
+	lg.ring = mem_deref(lg.ring);
+}
+
+
+void slog_write(enum slog_sub sub, enum slog_level level,
+	const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!lg.ring) {
+		char msg[MSG_SIZE];
+
+		va_start(ap, fmt);
+		(void)re_vsnprintf(msg, sizeof(msg), fmt, ap);
+		va_end(ap);
+
+		print_line(tmr_jiffies_rt_usec(), sub, level, msg);
+		return;
+	}
+
+	uint64_t pos = atomic_load_explicit(&lg.head, memory_order_relaxed);
+	struct entry *e;
+
+	for (;;) {
+		e = &lg.ring[pos & lg.mask];
+
+		uint64_t seq = atomic_load_explicit(&e->seq,
+			memory_order_acquire);
+		int64_t dif = (int64_t)(seq - pos);
+
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&lg.head,
+				&pos, pos + 1, memory_order_relaxed,
+				memory_order_relaxed))
+				break;
+		}
+		else if (dif < 0) {
+			/* full: the writer is a round behind */
+			atomic_fetch_add_explicit(&lg.dropped, 1,
+				memory_order_relaxed);
+			return;
+		}
+		else {
+			pos = atomic_load_explicit(&lg.head,
+				memory_order_relaxed);
+		}
+	}
+
+	e->time = tmr_jiffies_rt_usec();
+	e->sub = sub;
+	e->level = level;
+
+	va_start(ap, fmt);
+	(void)re_vsnprintf(e->msg, sizeof(e->msg), fmt, ap);
+	va_end(ap);
+
+	atomic_store_explicit(&e->seq, pos + 1, memory_order_release);
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&lg.sleeping, memory_order_relaxed))
+		wake();
+}
+
+
+void slog_level_set(enum slog_sub sub, enum slog_level level)
+{
+	if (sub < SLOG_SUBSYSTEMS)
+		atomic_store_explicit(&slog_levels[sub], level,
+			memory_order_relaxed);
+}
+
+
+int slog_level_parse(enum slog_level *level, const char *name)
+{
+	if (!level || !name)
+		return EINVAL;
+
+	for (size_t i = 0; i < ARRAY_SIZE(level_names); ++i) {
+		if (0 == str_casecmp(level_names[i], name)) {
+			*level = (enum slog_level)i;
+			return 0;
+		}
+	}
+
+	return ENOENT;
+}
+
+
+const char *slog_level_name(enum slog_level level)
+{
+	return level <= SLOG_DEBUG ? level_names[level] : "?";
+}
+
+
+int slog_sub_parse(enum slog_sub *sub, const char *name)
+{
+	if (!sub || !name)
+		return EINVAL;
+
+	for (size_t i = 0; i < SLOG_SUBSYSTEMS; ++i) {
+		if (0 == str_casecmp(sub_names[i], name)) {
+			*sub = (enum slog_sub)i;
+			return 0;
+		}
+	}
+
+	return ENOENT;
+}
+
+
+const char *slog_sub_name(enum slog_sub sub)
+{
+	return sub < SLOG_SUBSYSTEMS ? sub_names[sub] : "?";
+}
+
+
+uint64_t slog_dropped(void)
+{
+	return atomic_load_explicit(&lg.dropped, memory_order_relaxed);
+}
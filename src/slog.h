@@ -0,0 +1,87 @@
+/**
+ * @file slog.h  Asynchronous structured logging
+ *
+ * Copyright (C) 2023 Lars Immisch
+ *
+ * SLOG() formats an entry into a slot of a lock-free ring and returns; a
+ * background thread passes the entries to baresip's log as logfmt lines:
+ *
+ *   ts=1700000000.123456 level=info sub=sched msg="..."
+ *
+ * ts is the time of the SLOG() call, not of the write.
+ *
+ * Each subsystem has its own level, which can be changed at runtime. A
+ * disabled level costs one branch and no formatting. When the ring is
+ * full, entries are dropped and counted rather than blocking the caller.
+ * Any thread may log; levels are set on the main thread.
+ */
+
+#ifdef __cplusplus
+#include <atomic>
+#else
+#include <stdatomic.h>
+#endif
+
+enum slog_sub {
+	SLOG_VILLA,     /* commands and controller connections */
+	SLOG_SCHED,     /* the molecule queues */
+	SLOG_CALL,      /* call, DTMF and module events */
+	SLOG_JSON_TCP,  /* framing */
+	SLOG_SUBSYSTEMS
+};
+
+enum slog_level {
+	SLOG_OFF,
+	SLOG_ERROR,
+	SLOG_WARN,
+	SLOG_INFO,
+	SLOG_DEBUG
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the level of each subsystem, read relaxed. Another thread may see a
+   change a little later */
+#ifdef __cplusplus
+extern std::atomic<uint8_t> slog_levels[SLOG_SUBSYSTEMS];
+#define SLOG_LEVEL(sub) slog_levels[sub].load(std::memory_order_relaxed)
+#else
+extern _Atomic uint8_t slog_levels[SLOG_SUBSYSTEMS];
+#define SLOG_LEVEL(sub)							\
+	atomic_load_explicit(&slog_levels[sub], memory_order_relaxed)
+#endif
+
+#define SLOG(sub, level, ...)						\
+	do {								\
+		if (SLOG_LEVEL(sub) >= (level))				\
+			slog_write((sub), (level), __VA_ARGS__);	\
+	} while (0)
+
+/* set the level of a subsystem */
+void slog_level_set(enum slog_sub sub, enum slog_level level);
+
+/* start the writer thread with a ring of at least size entries. Before,
+   entries are written synchronously */
+int slog_init(uint32_t size);
+/* write the remaining entries and stop the writer thread */
+void slog_close(void);
+
+void slog_write(enum slog_sub sub, enum slog_level level,
+	const char *fmt, ...);
+
+/* parse "error", "warn", "info", "debug" or "off" */
+int slog_level_parse(enum slog_level *level, const char *name);
+const char *slog_level_name(enum slog_level level);
+
+/* the subsystem by name ("villa", "sched", "call", "json_tcp") */
+int slog_sub_parse(enum slog_sub *sub, const char *name);
+const char *slog_sub_name(enum slog_sub sub);
+
+/* entries dropped because the ring was full */
+uint64_t slog_dropped(void);
+
+#ifdef __cplusplus
+}
+#endif
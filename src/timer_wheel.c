@@ -0,0 +1,190 @@
+/**
+ * @file timer_wheel.c  Hierarchical timing wheel
+ *
+ * Copyright (C) 2023 Lars Immisch
+ */
+
+#include <string.h>
+#include <re.h>
+
+#include "timer_wheel.h"
+
+enum {
+	TW_BITS0 = 8,
+	TW_SIZE0 = 1 << TW_BITS0,
+	TW_MASK0 = TW_SIZE0 - 1,
+	TW_BITS = 6,
+	TW_SIZE = 1 << TW_BITS,
+	TW_MASK = TW_SIZE - 1,
+	TW_LEVELS = 4,  /* above level 0 */
+};
+
+#define TW_MAX_TICKS ((1ULL << (TW_BITS0 + TW_LEVELS * TW_BITS)) - 1)
+
+static struct {
+	struct list wheel0[TW_SIZE0];
+	struct list wheel[TW_LEVELS][TW_SIZE];
+	uint64_t now;    /* the next tick to run */
+	uint32_t count;
+	struct tmr tmr;
+} tw;
+
+
+static void wheel_add(struct wtmr *wt)
+{
+	uint64_t expires = wt->expires;
+	uint64_t delta;
+	struct list *l;
+
+	/* overdue timers run on the next tick */
+	if (expires < tw.now)
+		expires = tw.now;
+
+	delta = expires - tw.now;
+
+	if (delta > TW_MAX_TICKS) {
+		expires = tw.now + TW_MAX_TICKS;
+		delta = TW_MAX_TICKS;
+	}
+
+	if (delta < TW_SIZE0) {
+		l = &tw.wheel0[expires & TW_MASK0];
+	}
+	else {
+		int n = 0;
+
+		while (delta >= 1ULL << (TW_BITS0 + (n + 1) * TW_BITS))
+			++n;
+
+		l = &tw.wheel[n][(expires >> (TW_BITS0 + n * TW_BITS))
+			& TW_MASK];
+	}
+
+	wt->expires = expires;
+	list_append(l, &wt->le, wt);
+}
+
+
+/* move the timers in a slot of level n down, returns the slot index */
+static uint32_t cascade(int n)
+{
+	uint32_t index = (tw.now >> (TW_BITS0 + n * TW_BITS)) & TW_MASK;
+	struct list *l = &tw.wheel[n][index];
+	struct le *le;
+
+	while ((le = list_head(l))) {
+		list_unlink(le);
+		wheel_add(le->data);
+	}
+
+	return index;
+}
+
+
+static void wheel_run(uint64_t target)
+{
+	while (tw.now <= target && tw.count) {
+
+		uint32_t index = tw.now & TW_MASK0;
+		struct list *l = &tw.wheel0[index];
+		struct le *le;
+
+		if (!index) {
+			for (int n = 0; n < TW_LEVELS && !cascade(n); ++n)
+				;
+		}
+
+		++tw.now;
+
+		/* timers started by a handler land in later slots */
+		while ((le = list_head(l))) {
+			struct wtmr *wt = le->data;
+
+			list_unlink(le);
+			--tw.count;
+
+			wt->th(wt->arg);
+		}
+	}
+
+	if (!tw.count)
+		tw.now = target + 1;
+}
+
+
+static void tick_handler(void *arg)
+{
+	(void)arg;
+
+	wheel_run(tmr_jiffies() / WTMR_TICK);
+
+	if (tw.count)
+		tmr_start(&tw.tmr, WTMR_TICK, tick_handler, NULL);
+}
+
+
+void wtmr_init(struct wtmr *wt)
+{
+	if (!wt)
+		return;
+
+	memset(wt, 0, sizeof(*wt));
+}
+
+
+void wtmr_start(struct wtmr *wt, uint64_t delay, wtmr_h *th, void *arg)
+{
+	if (!wt)
+		return;
+
+	wtmr_cancel(wt);
+
+	if (!th)
+		return;
+
+	uint64_t jiffies = tmr_jiffies();
+
+	/* an idle wheel catches up with the clock */
+	if (!tw.count)
+		tw.now = jiffies / WTMR_TICK;
+
+	/* never early, at most one tick late */
+	wt->expires = (jiffies + delay + WTMR_TICK - 1) / WTMR_TICK;
+	wt->th = th;
+	wt->arg = arg;
+
+	wheel_add(wt);
+
+	if (!tw.count++)
+		tmr_start(&tw.tmr, WTMR_TICK, tick_handler, NULL);
+}
+
+
+void wtmr_cancel(struct wtmr *wt)
+{
+	if (!wt || !wt->le.list)
+		return;
+
+	list_unlink(&wt->le);
+
+	if (!--tw.count)
+		tmr_cancel(&tw.tmr);
+}
+
+
+bool wtmr_isrunning(const struct wtmr *wt)
+{
+	return wt && wt->le.list != NULL;
+}
+
+
+uint32_t timer_wheel_count(void)
+{
+	return tw.count;
+}
+
+
+void timer_wheel_close(void)
+{
+	tmr_cancel(&tw.tmr);
+}
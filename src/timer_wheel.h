@@ -0,0 +1,47 @@
+/**
+ * @file timer_wheel.h  Hierarchical timing wheel
+ *
+ * Copyright (C) 2023 Lars Immisch
+ *
+ * Timers with a resolution of WTMR_TICK ms for the record timeouts and
+ * deferred molecules of many calls. Starting and cancelling a timer is
+ * O(1). A single libre tmr drives the wheel while timers are pending.
+ *
+ * Level 0 has 256 slots of one tick each, the four levels above it have
+ * 64 slots each, covering 2.56 s, 164 s, 2.9 h and 7.7 days. Longer delays
+ * are clamped. Timers on the upper levels cascade down as the wheel turns.
+ */
+
+enum {
+	WTMR_TICK = 10,  /* ms */
+};
+
+typedef void (wtmr_h)(void *arg);
+
+struct wtmr {
+	struct le le;
+	uint64_t expires;  /* in ticks */
+	wtmr_h *th;
+	void *arg;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void wtmr_init(struct wtmr *wt);
+
+/* (re)start a timer that calls th after delay ms */
+void wtmr_start(struct wtmr *wt, uint64_t delay, wtmr_h *th, void *arg);
+void wtmr_cancel(struct wtmr *wt);
+bool wtmr_isrunning(const struct wtmr *wt);
+
+/* number of pending timers */
+uint32_t timer_wheel_count(void);
+
+/* stop driving the wheel, pending timers are dropped */
+void timer_wheel_close(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -4,18 +4,21 @@
  * Copyright (C) 2023 Lars Immisch
  */
 
-#define DEBUG_MODULE "villa"
-#define DEBUG_LEVEL 7
-
 #include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glob.h>
 #include <sstream>
+#include <fstream>
 #include <re.h>
 #include <baresip.h>
-#include <re_dbg.h>
 #include <stdexcept>
+#include <algorithm>
 
 #include "villa.h"
-#include "json_tcp.h"
+#include "json_reader.h"
+#include "iopool.h"
 
 //-------------------------------------------------------------------------
 
@@ -117,7 +120,7 @@ void Molecule::set_position(size_t position) {
 
 	for (size_t i = 0; i < _atoms.size(); ++i) {
 
-		AudioOpPtr a = _atoms[i];
+		Atom &a = _atoms[i];
 		l += a->length();
 
 		if (l >= position) {
@@ -143,924 +146,3840 @@ std::string Molecule::desc() const {
 	return desc;
 }
 
-AudioOpPtr &Molecule::current() {
+void Molecule::assign(const Molecule &proto, Session *session) {
 
-	if (_current >= _atoms.size()) {
-		throw std::out_of_range("no current atom");
+	_atoms.clear();
+	for (auto &a : proto._atoms) {
+		_atoms.push_back(a);
+		_atoms.back()->_session = session;
 	}
 
-	return _atoms[_current];
+	_current = 0;
+	_time_started = 0;
+	_time_stopped = 0;
+	_priority = proto._priority;
+	_mode = proto._mode;
+	_id = proto._id;
 }
 
-// @pragma mark VQueue
-
-VQueue::discard_result VQueue::discard(Molecule* m) {
-
-	discard_result result = discard_nothing;
+Atom &Molecule::current() {
 
-	for (auto i = _molecules[m->_priority].begin();
-		i != _molecules[m->_priority].end(); ++i) {
-
-		if (m == &(*i)) {
-			_molecules[m->_priority].erase(i);
-			result = discard_inactive;
-			break;
-		}
-	}
-
-	if (m == _active) {
-		_session->molecule_done(*_active);
-		_active = nullptr;
-		return discard_active;
+	if (_current >= _atoms.size()) {
+		throw std::out_of_range("no current atom");
 	}
 
-	return result;
+	return _atoms[_current];
 }
 
-std::vector<Molecule>::iterator VQueue::next() {
+// @pragma mark MoleculePool
 
-	for (int p = max_priority; p >= 0; --p) {
+Molecule *MoleculePool::alloc() {
 
-		for (auto i = _molecules[p].begin();
-			i != _molecules[p].end(); ++i) {
-
-			if (i->_atoms.size()) {
-				return i;
-			}
-		}
+	if (_free.empty()) {
+		_nodes.emplace_back();
+		return &_nodes.back();
 	}
 
-	return end();
+	Molecule *m = _free.back();
+	_free.pop_back();
+
+	return m;
 }
 
-#pragma mark Play
+void MoleculePool::release(Molecule *m) {
 
-size_t Play::set_filename(const std::string& filename) {
+	list_unlink(&m->_le);
+	wtmr_cancel(&m->_tmr);
+	m->_queue = nullptr;
 
-	struct aufile* au = nullptr;
-	struct aufile_prm prm;
-	struct config_audio *cfg = &conf_config()->audio;
+	// keep the capacity of the atoms and the id
+	m->_atoms.clear();
+	m->_current = 0;
+	m->_time_started = 0;
+	m->_time_stopped = 0;
+	m->_priority = 0;
+	m->_mode = (mode)0;
+	m->_id.clear();
 
-	_filename = filename;
+	_free.push_back(m);
+}
 
-	std::string path(cfg->audio_path);
-	if (path.back() != '/') {
-		path += "/";
-	}
-	path += filename;
+// @pragma mark VQueue
 
-	int err = aufile_open(&au, &prm, path.c_str(), AUFILE_READ);
-	if (err) {
-		return 0;
+uint32_t Priorities = 6;
+
+MoleculePool Molecules;
+
+// Kept up to date by the queues and the session table, so stats don't
+// walk the sessions on the main loop
+static struct {
+	size_t sessions = 0;
+	size_t orphans = 0;
+	// queued molecules per priority, of all sessions
+	size_t depths[max_priorities] = {};
+	size_t deferred = 0;
+} Queued;
+
+// index of the highest set bit, mask must not be 0
+inline int highest_bit(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+	return 63 - __builtin_clzll(mask);
+#else
+	int bit = 0;
+	while (mask >>= 1) {
+		++bit;
 	}
-
-	size_t length = aufile_get_length(au, &prm);
-
-	mem_deref(au);
-
-	return length;
+	return bit;
+#endif
 }
 
-std::string Play::desc() const {
-	std::stringstream s;
-	s << "play " << _filename << " offset: " << _offset;
-	return s.str();
+VQueue::VQueue(Session *session) : _lists(Priorities), _session(session) {
+	for (auto &l : _lists) {
+		list_init(&l);
+	}
 }
 
-int Play::start() {
+void VQueue::clear() {
 
-	_audio = call_audio(_session->_call);
-	_stopped = false;
+	_tokens.clear();
+	_active = nullptr;
+	_nonempty = 0;
 
-	// int err = audio_set_source(_audio, "aufile", _filename.c_str());
-	int err = audio_set_source_offset(_audio, "aufile", _filename.c_str(), _offset);
-	if (err) {
-		warning("villa: can't start playing %s: %s\n", _filename.c_str(), strerror(errno));
-		_audio = nullptr;
+	for (size_t p = 0; p < _lists.size(); ++p) {
+		while (struct le *le = list_head(&_lists[p])) {
+			Molecules.release((Molecule*)le->data);
+			--Queued.depths[p];
+		}
 	}
 
-	return err;
-}
-
-void Play::stop()
-{
-	if (_audio) {
-		audio_set_source(_audio, nullptr, nullptr);
-		_audio = nullptr;
-		_stopped = true;
+	while (struct le *le = list_head(&_deferred)) {
+		Molecules.release((Molecule*)le->data);
+		--Queued.deferred;
 	}
 }
 
-size_t Play::length() const
-{
-	if (_length) {
-		return _length;
+void VQueue::remove(Molecule *m) {
+
+	if (!m->_id.empty()) {
+		auto range = _tokens.equal_range(m->_id);
+		for (auto i = range.first; i != range.second; ++i) {
+			if (i->second == m) {
+				_tokens.erase(i);
+				break;
+			}
+		}
 	}
 
-	struct aufile *f;
-	struct aufile_prm p;
+	if (m->_le.list == &_deferred) {
+		--Queued.deferred;
+	}
+	else if (m->_le.list) {
+		--Queued.depths[m->_priority];
+	}
 
-	int err = aufile_open(&f, &p, _filename.c_str(), AUFILE_READ);
-	if (err < 0) {
-		return 0;
+	list_unlink(&m->_le);
+	if (list_isempty(&_lists[m->_priority])) {
+		_nonempty &= ~(1ULL << m->_priority);
 	}
 
-	_length = aufile_get_length(f, &p);
+	Molecules.release(m);
+}
 
-	mem_deref(f);
+Molecule *VQueue::alloc() {
+	return Molecules.alloc();
+}
 
-	return _length;
+void VQueue::release(Molecule *m) {
+	Molecules.release(m);
 }
 
-#pragma mark Record
+VQueue::discard_result VQueue::discard(Molecule* m) {
 
-void record_timer(void *arg) {
+	if (!m->_le.list) {
+		return discard_nothing;
+	}
 
-	Record::TimerId *timer = (Record::TimerId*)arg;
+	discard_result result = discard_inactive;
 
-	DEBUG_PRINTF("%s recording %s stopped. Reason: %s\n",
-		timer->record->_session->_id.c_str(),
-		timer->record->filename().c_str(),
-		timer->timer_id == Record::timer_max_silence ? "max silence" : "max length");
+	if (m == _active) {
+		_session->molecule_done(*_active);
+		_active = nullptr;
+		result = discard_active;
+	}
 
-	timer->record->stop();
-	timer->record->_session->_queue.schedule(VQueue::sched_end_of_file);
-}
+	remove(m);
 
-int Record::start() {
+	return result;
+}
 
-	_audio = call_audio(_session->_call);
-	_stopped = false;
+size_t VQueue::discard(std::vector<Molecule*> &ms, bool &active) {
 
-	int err = audio_set_player(_audio, "aufile", _filename.c_str());
-	if (err) {
-		warning("villa: can't start recording %s: %s\n", _filename.c_str(), strerror(errno));
-		_audio = nullptr;
-		return err;
+	for (Molecule *m : ms) {
+		if (discard(m) == discard_active) {
+			active = true;
+		}
 	}
 
-	if (_max_length > 0) {
-		tmr_start(&_tmr_max_length, _max_length, record_timer, &_timer_max_length_id);
-	}
+	return ms.size();
+}
 
-	if (_max_silence > 0 && !_session->_vad) {
-		tmr_start(&_tmr_max_silence, _max_silence, record_timer, &_timer_max_silence_id);
+size_t VQueue::discard_token(std::string_view token, bool &active) {
+
+	std::vector<Molecule*> ms;
+
+	auto range = _tokens.equal_range(token);
+	for (auto i = range.first; i != range.second; ++i) {
+		ms.push_back(i->second);
 	}
 
-	return err;
+	return discard(ms, active);
 }
 
-void Record::stop() {
+size_t VQueue::discard_prefix(std::string_view prefix, bool &active) {
 
-	if (_audio) {
-		_stopped = true;
+	std::vector<Molecule*> ms;
 
-		tmr_cancel(&_tmr_max_length);
-		tmr_cancel(&_tmr_max_silence);
+	for (auto &[token, m] : _tokens) {
+		if (token.substr(0, prefix.size()) == prefix) {
+			ms.push_back(m);
+		}
+	}
 
-		audio_set_player(_audio, nullptr, nullptr);
+	return discard(ms, active);
+}
 
-		_audio = nullptr;
+void VQueue::discard_range(uint32_t from, uint32_t to) {
+
+	if (_active) {
+		_active->stop();
+		_active = nullptr;
 	}
-}
 
-void Record::event_vad(Session*, bool vad) {
-	if (_max_silence > 0) {
-		if (vad) {
-			tmr_cancel(&_tmr_max_silence);
-		}
-		else {
-			tmr_start(&_tmr_max_silence, _max_silence, record_timer, &_timer_max_silence_id);
+	for (uint32_t p = from; p < to && p < _lists.size(); ++p) {
+		while (struct le *le = list_head(&_lists[p])) {
+			remove((Molecule*)le->data);
 		}
 	}
 }
 
-void Record::event_dtmf(Session *session, char, bool end)
-{
-	if (!end && _dtmf_stop) {
-		DEBUG_PRINTF("%s recording %s stopped. Reason: dtmf\n", session->_id.c_str(), _filename.c_str());
+Molecule *VQueue::find(std::string_view id) {
 
-		stop();
-		session->_queue.schedule(VQueue::sched_end_of_file);
-	}
-}
+	auto i = _tokens.find(id);
 
-std::string Record::desc() const {
-	std::stringstream s;
-	s << "record " << _filename << " max_silence: " << _max_silence << " max_length: " <<  _max_length;
-	return s.str();
+	return i == _tokens.end() ? nullptr : i->second;
 }
 
-#pragma mark VQueue
+Molecule *VQueue::next() {
 
-int VQueue::schedule(reason r) {
+	if (!_nonempty) {
+		return nullptr;
+	}
 
-	size_t now = tmr_jiffies();
+	struct le *le = list_head(&_lists[highest_bit(_nonempty)]);
 
-	auto current = next();
-	if (current == end()) {
-		_active = nullptr;
-		return 0;
-	}
+	return (Molecule*)le->data;
+}
 
-	if (_active) {
+void VQueue::prefetch() const {
 
-		// Just remove Molecules with m_discard that are interrupted
-		if (_active->_mode & m_discard && _active != &*current) {
-			discard(_active);
-		}
-		else if (_active == &(*current)) {
-			// The current molecule was stopped or played to the end
+	uint32_t n = PrefetchAtoms;
 
-			if (r == sched_end_of_file) {
-				++current->_current;
-				if (!current->is_active()) {
-					current->_time_stopped = now;
-				}
-			}
-			else {
-				current->_time_stopped = now;
-				current->set_position(now - current->_time_started);
+	auto ahead = [&n](const Molecule *m, size_t from) {
+		size_t size = m->size();
+		// a loop starts over after its last atom
+		size_t count = m->_mode & m_loop ? size : size - std::min(from, size);
+		for (size_t k = 0; k < count && n; ++k, --n) {
+			if (const Play *p = std::get_if<Play>(&m->_atoms[(from + k) % size]._op)) {
+				asset_prefetch(p->asset());
 			}
 		}
-	}
+	};
 
-	if (current->_mode & m_loop) {
+	if (_active) {
+		ahead(_active, _active->_current + 1);
+	}
 
-		if (current->_mode & m_restart && !current->is_active()) {
-			current->set_position(0);
-		}
-		else if (current->_mode & m_mute) {
-			size_t length = current->length();
-			size_t pos = current->_time_started ? (now - current->_time_started) % length : 0;
-			DEBUG_PRINTF("setting position to %d\n", pos);
-			current->set_position(pos);
-		}
-		else if (current->_mode & m_pause) {
-			size_t pos = 0;
-			if (current->is_active()) {
-				pos = current->_time_stopped ? (current->_time_stopped - current->_time_started) % current->length() : 0;
+	// The molecule that resumes or starts when the active one is done
+	for (uint64_t bits = _nonempty; bits && n; bits &= ~(1ULL << highest_bit(bits))) {
+		for (struct le *le = list_head(&_lists[highest_bit(bits)]); le; le = le->next) {
+			const Molecule *m = (const Molecule*)le->data;
+			if (m != _active) {
+				ahead(m, m->_current);
+				return;
 			}
-			current->set_position(pos);
 		}
 	}
+}
 
-	if (current->is_active()) {
-
-		AudioOpPtr &a = current->current();
-		int err = a->start();
-		if (err) {
-			DEBUG_PRINTF("%s failed: %s\n", a->desc().c_str(), strerror(err));
-			current->_atoms.erase(current->_atoms.begin() + current->_current);
-			current->_current++;
-			return err;
-		}
+#pragma mark Play
 
-		if (current->_current == 0) {
-			current->_time_started = now;
+// Assets never move, the index refers to their names. Evicted assets leave
+// their slot to the next new asset
+std::deque<Asset> AssetStore;
+std::vector<Asset*> AssetSlots;
+std::unordered_map<std::string_view, Asset*> Assets;
+uint64_t AssetClock = 0;
+
+// Evict the least recently used assets that are neither referenced nor
+// busy on the I/O pool, down to three quarters of max_assets
+static void evict_assets() {
+
+	std::vector<Asset*> idle;
+	for (auto &[name, a] : Assets) {
+		if (!a->refs && !a->resolving && !a->prefetching && a->waiters.empty()) {
+			idle.push_back(a);
 		}
-		_active = &(*current);
-		DEBUG_INFO("%s started\n", a->desc().c_str());
 	}
-	else {
-		_active = nullptr;
-		_molecules[current->_priority].erase(current);
-		_session->molecule_done(*current);
 
-		return schedule(r);
+	size_t excess = Assets.size() - std::min(Assets.size(), size_t(max_assets * 3 / 4));
+	size_t n = std::min(excess, idle.size());
+
+	std::nth_element(idle.begin(), idle.begin() + n, idle.end(),
+		[](const Asset *a, const Asset *b) { return a->used < b->used; });
+
+	for (size_t i = 0; i < n; ++i) {
+		Asset *a = idle[i];
+		Assets.erase(std::string_view(a->name));
+		*a = Asset();
+		AssetSlots.push_back(a);
 	}
 
-	return 0;
+	SLOG(SLOG_VILLA, SLOG_DEBUG, "evicted %zu of %zu assets\n", n, Assets.size() + n);
 }
 
-int VQueue::enqueue(const Molecule& m) {
-	_molecules[m._priority].push_back(m);
+Asset *asset(std::string_view filename) {
 
-	if (!_active || _active->_priority < m._priority) {
-		if (_active) {
-			size_t now = tmr_jiffies();
+	auto ait = Assets.find(filename);
+	if (ait != Assets.end()) {
+		ait->second->used = ++AssetClock;
+		return ait->second;
+	}
 
-			_active->_time_stopped = now;
-		}
+	if (Assets.size() >= max_assets) {
+		evict_assets();
+	}
 
-		return schedule(sched_interrupt);
+	Asset *a;
+	if (AssetSlots.empty()) {
+		AssetStore.emplace_back();
+		a = &AssetStore.back();
+	}
+	else {
+		a = AssetSlots.back();
+		AssetSlots.pop_back();
 	}
 
-	return 0;
+	a->name = std::string(filename);
+	a->used = ++AssetClock;
+	Assets.insert(std::make_pair(std::string_view(a->name), a));
+
+	return a;
 }
 
-Session::Session(struct call *call, struct json_tcp *jt) : _call(call), _jt(jt), _queue(this) {
-	_id = call_id(call);
+// Threads that open assets, null if they are opened on the main loop
+struct iopool *IoPool = nullptr;
+
+Metrics Counters;
+Latencies Latency;
+uint64_t CommandArrived = 0;
+
+static uint64_t jiffies() {
+	return tmr_jiffies();
 }
 
-void Session::molecule_done(const Molecule& m) const {
+static int set_source(struct audio *au, const char *mod, const char *device, size_t offset) {
+	return mod ? audio_set_source_offset(au, mod, device, offset) : audio_set_source(au, nullptr, nullptr);
+}
 
-	if (!m._id.empty()) {
-		odict *od = nullptr;
-		odict_alloc(&od, DICT_BSIZE);
+AudioSeam Audio = { jiffies, call_audio, set_source, audio_set_player };
 
-		odict_entry_add(od, "event", ODICT_BOOL, true);
-		odict_entry_add(od, "type", ODICT_STRING, "molecule_done");
-		odict_entry_add(od, "id", ODICT_STRING, _id.c_str());
-		odict_entry_add(od, "token", ODICT_STRING, m._id.c_str());
+// The directory of the audio files, with a trailing slash
+static std::string audio_path() {
 
-		json_tcp_send(_jt, od);
+	struct config_audio *cfg = &conf_config()->audio;
+
+	std::string path(cfg->audio_path);
+	if (path.empty() || path.back() != '/') {
+		path += "/";
 	}
+
+	return path;
 }
 
-void Session::dtmf(char key) {
+static std::string asset_path(const Asset *a) {
 
-	odict *od;
-	odict_alloc(&od, DICT_BSIZE);
+	return audio_path() + a->name;
+}
 
-	odict_entry_add(od, "event", ODICT_BOOL, true);
-	odict_entry_add(od, "id", ODICT_STRING, _id.c_str());
+// The length in ms, 0 if the file can't be opened. Blocks on the filesystem
+static size_t asset_open(const std::string &path) {
 
-	if (key != '\x04') {
-		char k[2] = { key, 0 };
-		_dtmf = k;
-		odict_entry_add(od, "type", ODICT_STRING, "dtmf_begin");
-		odict_entry_add(od, "key", ODICT_STRING, _dtmf.c_str());
+	struct aufile* au = nullptr;
+	struct aufile_prm prm;
 
-		_dtmf_start = std::chrono::system_clock::now();
+	int err = aufile_open(&au, &prm, path.c_str(), AUFILE_READ);
+	if (err) {
+		return 0;
 	}
 
-	Molecule *active = _queue._active;
-	if (active && active->is_active()) {
-		active->current()->event_dtmf(this,_dtmf[0], key == '\x04');
+	size_t length = aufile_get_length(au, &prm);
+
+	mem_deref(au);
+
+	return length;
+}
+
+// A job of a pool whose result is posted to the main thread
+struct MainJob {
+	// set if the post failed
+	iopool_job_h *done = nullptr;
+	void *arg = nullptr;
+	MainJob *next = nullptr;
+};
+
+// Jobs whose results couldn't be posted to the main thread
+static std::atomic<MainJob*> LostMainJobs{nullptr};
+
+// Run done(job) on the main thread. Runs on a pool thread. If the post
+// fails, the job is kept for recover_main_jobs, so its result is never lost
+template <typename Job>
+static void post_main(struct iopool *pool, Job *job, iopool_job_h *done, const char *what) {
+
+	int err = iopool_post_main(pool, done, job);
+	if (!err) {
+		return;
 	}
 
-	if (key == '\x04') { // end-of-transmission
-		auto now = std::chrono::system_clock::now();
+	warning("villa: failed to post the result for %s (%m)\n", what, err);
 
-		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now - _dtmf_start);
-		odict_entry_add(od, "type", ODICT_STRING, "dtmf_end");
-		odict_entry_add(od, "key", ODICT_STRING, _dtmf.c_str());
-		odict_entry_add(od, "duration", ODICT_INT, duration);
-		_dtmf.erase();
+	MainJob *m = job;
+	m->done = done;
+	m->arg = job;
+	m->next = LostMainJobs.load(std::memory_order_relaxed);
+	while (!LostMainJobs.compare_exchange_weak(m->next, m,
+			std::memory_order_release, std::memory_order_relaxed)) {
 	}
+}
+
+// Run the jobs that failed to post their results. Runs on the main
+// thread, from the timer of the event loop lag
+static void recover_main_jobs() {
 
-	json_tcp_send(_jt, od);
+	MainJob *m = LostMainJobs.exchange(nullptr, std::memory_order_acquire);
+
+	while (m) {
+		MainJob *next = m->next;
+		m->done(m->arg);
+		m = next;
+	}
 }
 
-void Session::hangup(int16_t scode, const char* reason) {
-	if (_call) {
-		call_hangup(_call, scode , reason);
-		_call = nullptr;
+// Opening an asset on the I/O pool
+struct AssetJob : MainJob {
+	AssetJob(Asset *a, std::string p) : asset(a), path(std::move(p)) {}
 
-		odict *od;
-		odict_alloc(&od, DICT_BSIZE);
+	Asset *asset;
+	std::string path;
+	size_t length = 0;
+};
 
-		odict_entry_add(od, "event", ODICT_BOOL, true);
-		odict_entry_add(od, "type", ODICT_STRING, "call_closed");
-		odict_entry_add(od, "status_code", ODICT_INT, scode);
-		odict_entry_add(od, "reason", ODICT_STRING, reason);
-		odict_entry_add(od, "id", ODICT_STRING, _id.c_str());
+// Runs on the main thread
+static void asset_opened(void *arg) {
+
+	std::unique_ptr<AssetJob> job((AssetJob*)arg);
+	Asset *a = job->asset;
 
-		json_tcp_send(_jt, od);
+	// not cached on failure, the file may appear later
+	a->length = job->length;
+	a->resolving = false;
+
+	// waiters may resolve the asset again
+	auto waiters = std::move(a->waiters);
+	a->waiters.clear();
+
+	for (auto &done : waiters) {
+		done();
 	}
 }
 
-Session::~Session() {
-	hangup();
+// Runs on the I/O pool
+static void asset_job(void *arg) {
+
+	AssetJob *job = (AssetJob*)arg;
+
+	job->length = asset_open(job->path);
+
+	post_main(IoPool, job, asset_opened, job->path.c_str());
 }
 
-std::unordered_map<std::string, Session> Sessions;
-std::vector<ua*> UserAgents;
-std::unordered_map<std::string,call*> PendingCalls;
+void asset_resolve(Asset *a, std::function<void()> done) {
 
-odict *create_response(const char* type, const char* token, int result, const char* message=nullptr)
+	if (a->length || !IoPool) {
+		asset_length(a);
+		if (done) {
+			done();
+		}
+		return;
+	}
+
+	if (done) {
+		a->waiters.push_back(std::move(done));
+	}
+
+	if (a->resolving) {
+		return;
+	}
+
+	static uint32_t next = 0;
+
+	AssetJob *job = new AssetJob(a, asset_path(a));
+	a->resolving = true;
+
+	int err = iopool_post(IoPool, next++, asset_job, job);
+	if (err) {
+		warning("villa: failed to open %s on the I/O pool (%m)\n", a->name.c_str(), err);
+		asset_opened(job);
+	}
+}
+
+// Atoms prefetched ahead of the current one per session, 0 disables it
+uint32_t PrefetchAtoms = 2;
+// Bytes per second that may be prefetched by all sessions together
+uint64_t PrefetchRate = 64 << 20;
+// Prefetched files are assumed to be cached for this long, in ms
+enum { prefetch_ttl = 30000 };
+
+struct PrefetchBudget {
+	int64_t bytes = 0;
+	uint64_t refilled = 0;
+	uint64_t issued = 0;
+	uint64_t skipped = 0;
+} Prefetch;
+
+// Warming the page cache for an asset on the I/O pool
+struct PrefetchJob : MainJob {
+	PrefetchJob(Asset *a, std::string p) : asset(a), path(std::move(p)) {}
+
+	Asset *asset;
+	std::string path;
+	size_t bytes = 0;
+};
+
+// Runs on the main thread
+static void prefetch_done(void *arg) {
+
+	std::unique_ptr<PrefetchJob> job((PrefetchJob*)arg);
+
+	job->asset->prefetching = false;
+	job->asset->prefetched = tmr_jiffies();
+	Prefetch.bytes -= job->bytes;
+}
+
+// Runs on the I/O pool. The kernel reads ahead in the background
+static void prefetch_job(void *arg) {
+
+	PrefetchJob *job = (PrefetchJob*)arg;
+
+	int fd = open(job->path.c_str(), O_RDONLY);
+	if (fd >= 0) {
+		struct stat st;
+		if (fstat(fd, &st) == 0) {
+			job->bytes = st.st_size;
+		}
+#ifdef POSIX_FADV_WILLNEED
+		(void)posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+		close(fd);
+	}
+
+	post_main(IoPool, job, prefetch_done, job->path.c_str());
+}
+
+void asset_prefetch(Asset *a) {
+
+	if (!IoPool || !PrefetchAtoms || a->prefetching) {
+		return;
+	}
+
+	uint64_t now = tmr_jiffies();
+
+	if (a->prefetched && now - a->prefetched < prefetch_ttl) {
+		return;
+	}
+
+	// refill the budget, at most one second ahead
+	int64_t rate = PrefetchRate;
+	int64_t elapsed = std::min<uint64_t>(now - Prefetch.refilled, 1000);
+	Prefetch.bytes = std::min(rate, Prefetch.bytes + rate * elapsed / 1000);
+	Prefetch.refilled = now;
+
+	if (Prefetch.bytes <= 0) {
+		++Prefetch.skipped;
+		return;
+	}
+
+	static uint32_t next = 0;
+
+	PrefetchJob *job = new PrefetchJob(a, asset_path(a));
+	a->prefetching = true;
+
+	int err = iopool_post(IoPool, next++, prefetch_job, job);
+	if (err) {
+		a->prefetching = false;
+		delete job;
+		return;
+	}
+
+	++Prefetch.issued;
+}
+
+size_t asset_length(Asset *a) {
+
+	if (a->length) {
+		Metrics::count(Counters.asset_hits);
+		return a->length;
+	}
+
+	Metrics::count(Counters.asset_misses);
+
+	if (IoPool) {
+		asset_resolve(a, nullptr);
+		return 0;
+	}
+
+	// not cached on failure, the file may appear later
+	a->length = asset_open(asset_path(a));
+
+	return a->length;
+}
+
+#pragma mark Preload
+
+// The preload of the manifest at startup, null when it is done
+Preload *StartupPreload = nullptr;
+// The preloads that are not done
+static std::unordered_set<Preload*> Preloads;
+// One thread per core, shared by all preloads. Started by the first one
+static struct iopool *PreloadPool = nullptr;
+// Set on close, so the threads skip the jobs left in their queues
+static std::atomic<bool> PreloadClosing{false};
+
+// Expanding the patterns of a preload into asset names
+struct PreloadExpand : MainJob {
+	PreloadExpand(Preload *p, std::string b, std::vector<std::string> pt)
+		: preload(p), base(std::move(b)), patterns(std::move(pt)) {}
+
+	Preload *preload;
+	std::string base;
+	std::vector<std::string> patterns;
+	std::vector<std::string> names;
+};
+
+// Reading an asset into the page cache
+struct PreloadJob : MainJob {
+	PreloadJob(Preload *pr, Asset *a, std::string p) : preload(pr), asset(a), path(std::move(p)) {}
+
+	Preload *preload;
+	// the asset must not be evicted while it is read
+	AssetRef asset;
+	std::string path;
+	size_t length = 0;
+	size_t bytes = 0;
+};
+
+static void preload_free(Preload *p) {
+
+	tmr_cancel(&p->tmr_progress);
+	Preloads.erase(p);
+	delete p;
+}
+
+static void preload_finish(Preload *p) {
+
+	p->ms = tmr_jiffies() - p->started;
+
+	info("villa: preloaded %zu assets (%zu MB, %zu missing) in %llu ms\n",
+		p->done, p->bytes >> 20, p->missing, (unsigned long long)p->ms);
+
+	if (StartupPreload == p) {
+		StartupPreload = nullptr;
+	}
+
+	auto waiters = std::move(p->waiters);
+	for (auto &done : waiters) {
+		done();
+	}
+
+	preload_free(p);
+}
+
+static void preload_progress(void *arg) {
+
+	Preload *p = (Preload*)arg;
+
+	info("villa: preloading %zu/%zu assets, %zu MB\n", p->done, p->total, p->bytes >> 20);
+
+	tmr_start(&p->tmr_progress, 1000, preload_progress, p);
+}
+
+// Runs on the main thread
+static void preload_done(void *arg) {
+
+	std::unique_ptr<PreloadJob> job((PreloadJob*)arg);
+	Preload *p = job->preload;
+
+	if (job->length) {
+		job->asset->length = job->length;
+		job->asset->prefetched = tmr_jiffies();
+	}
+	else {
+		++p->missing;
+	}
+
+	p->bytes += job->bytes;
+
+	if (++p->done == p->total) {
+		preload_finish(p);
+	}
+}
+
+// Runs on a preload thread: parse the header and read the whole file.
+// This warms the page cache and the asset length only; the samples are
+// decoded by baresip's aufile source when they play, so there is no
+// decoded cache to fill
+static void preload_job(void *arg) {
+
+	PreloadJob *job = (PreloadJob*)arg;
+
+	if (PreloadClosing.load(std::memory_order_relaxed)) {
+		delete job;
+		return;
+	}
+
+	job->length = asset_open(job->path);
+
+	int fd = job->length ? open(job->path.c_str(), O_RDONLY) : -1;
+	if (fd >= 0) {
+		std::vector<char> buf(1 << 16);
+		ssize_t n;
+
+		while ((n = read(fd, buf.data(), buf.size())) > 0) {
+			job->bytes += n;
+		}
+
+		close(fd);
+	}
+
+	post_main(PreloadPool, job, preload_done, job->path.c_str());
+}
+
+// Runs on the main thread
+static void preload_expanded(void *arg) {
+
+	std::unique_ptr<PreloadExpand> job((PreloadExpand*)arg);
+	Preload *p = job->preload;
+
+	p->total = job->names.size();
+	if (!p->total) {
+		preload_finish(p);
+		return;
+	}
+
+	for (size_t i = 0; i < job->names.size(); ++i) {
+		Asset *a = asset(job->names[i]);
+		PreloadJob *pj = new PreloadJob(p, a, asset_path(a));
+
+		if (iopool_post(PreloadPool, i, preload_job, pj)) {
+			delete pj;
+			++p->missing;
+			if (++p->done == p->total) {
+				preload_finish(p);
+			}
+		}
+	}
+}
+
+// Runs on a preload thread. Manifests have a path or glob per line,
+// relative to audio_path. Empty lines and lines starting with # are skipped
+static void preload_expand(void *arg) {
+
+	PreloadExpand *job = (PreloadExpand*)arg;
+	Preload *p = job->preload;
+	std::vector<std::string> patterns;
+
+	if (PreloadClosing.load(std::memory_order_relaxed)) {
+		delete job;
+		return;
+	}
+
+	if (!p->manifest.empty()) {
+		std::ifstream f(p->manifest);
+		if (!f) {
+			warning("villa: can't read preload manifest %s\n", p->manifest.c_str());
+		}
+
+		std::string line;
+		while (std::getline(f, line)) {
+			size_t first = line.find_first_not_of(" \t");
+			size_t last = line.find_last_not_of(" \t\r");
+			if (first == line.npos || line[first] == '#') {
+				continue;
+			}
+			patterns.push_back(line.substr(first, last - first + 1));
+		}
+	}
+
+	patterns.insert(patterns.end(), job->patterns.begin(), job->patterns.end());
+
+	for (auto &pattern : patterns) {
+		glob_t g;
+		std::string full = job->base + pattern;
+
+		if (glob(full.c_str(), 0, nullptr, &g) == 0) {
+			for (size_t i = 0; i < g.gl_pathc; ++i) {
+				job->names.push_back(std::string(g.gl_pathv[i] + job->base.size()));
+			}
+		}
+		globfree(&g);
+	}
+
+	post_main(PreloadPool, job, preload_expanded, "the preload file list");
+}
+
+Preload *preload(std::vector<std::string> patterns, std::string manifest) {
+
+	if (!PreloadPool) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		uint32_t threads = cores < 1 ? 1 : std::min<long>(cores, max_preload_threads);
+
+		int err = iopool_alloc(&PreloadPool, threads);
+		if (err) {
+			warning("villa: failed to start %u preload threads (%m)\n", threads, err);
+			return nullptr;
+		}
+	}
+
+	Preload *p = new Preload();
+	p->manifest = std::move(manifest);
+	p->started = tmr_jiffies();
+	tmr_init(&p->tmr_progress);
+	tmr_start(&p->tmr_progress, 1000, preload_progress, p);
+	Preloads.insert(p);
+
+	PreloadExpand *job = new PreloadExpand(p, audio_path(), std::move(patterns));
+	int err = iopool_post(PreloadPool, 0, preload_expand, job);
+	if (err) {
+		delete job;
+		preload_finish(p);
+		return nullptr;
+	}
+
+	return p;
+}
+
+size_t Play::set_filename(std::string_view filename) {
+
+	_asset = ::asset(filename);
+
+	return asset_length(_asset);
+}
+
+std::string Play::desc() const {
+	std::stringstream s;
+	s << "play " << _asset->name << " offset: " << _offset;
+	return s.str();
+}
+
+int Play::start() {
+
+	_audio = Audio.call_audio(_session->_call);
+	_stopped = false;
+
+	int err = Audio.set_source(_audio, "aufile", _asset->name.c_str(), _offset);
+	if (err) {
+		warning("villa: can't start playing %s: %s\n", _asset->name.c_str(), strerror(errno));
+		_audio = nullptr;
+	}
+
+	return err;
+}
+
+void Play::stop()
 {
-	odict *od = nullptr;
-	odict_alloc(&od, DICT_BSIZE);
+	if (_audio) {
+		Audio.set_source(_audio, nullptr, nullptr, 0);
+		_audio = nullptr;
+		_stopped = true;
+	}
+}
 
-	odict_entry_add(od, "type", ODICT_STRING, type);
-	odict_entry_add(od, "class", ODICT_STRING, "villa");
-	odict_entry_add(od, "response", ODICT_BOOL, true);
-	if (token) {
-		odict_entry_add(od, "token", ODICT_STRING, token);
+size_t Play::length() const
+{
+	return asset_length(_asset);
+}
+
+#pragma mark Record
+
+void record_timer(void *arg) {
+
+	Record::TimerId *timer = (Record::TimerId*)arg;
+
+	SLOG(SLOG_SCHED, SLOG_INFO, "%s recording %s stopped. Reason: %s\n",
+		timer->record->_session->_id.c_str(),
+		timer->record->filename().c_str(),
+		timer->timer_id == Record::timer_max_silence ? "max silence" : "max length");
+
+	timer->record->stop();
+	timer->record->_session->_queue.schedule(VQueue::sched_end_of_file);
+}
+
+int Record::start() {
+
+	_audio = Audio.call_audio(_session->_call);
+	_stopped = false;
+
+	int err = Audio.set_player(_audio, "aufile", _filename.c_str());
+	if (err) {
+		warning("villa: can't start recording %s: %s\n", _filename.c_str(), strerror(errno));
+		_audio = nullptr;
+		return err;
 	}
-	odict_entry_add(od, "result", ODICT_INT, result);
-	if (message) {
-		odict_entry_add(od, "message", ODICT_STRING, message);
+
+	if (_max_length > 0) {
+		wtmr_start(&_tmr_max_length, _max_length, record_timer, &_timer_max_length_id);
+	}
+
+	if (_max_silence > 0 && !_session->_vad) {
+		wtmr_start(&_tmr_max_silence, _max_silence, record_timer, &_timer_max_silence_id);
+	}
+
+	return err;
+}
+
+// Runs on the I/O pool
+static void record_size(void *arg) {
+
+	std::unique_ptr<std::string> path((std::string*)arg);
+	struct stat st;
+
+	if (stat(path->c_str(), &st) == 0) {
+		Metrics::count(Counters.record_bytes, st.st_size);
+	}
+}
+
+void Record::stop() {
+
+	if (_audio) {
+		_stopped = true;
+
+		wtmr_cancel(&_tmr_max_length);
+		wtmr_cancel(&_tmr_max_silence);
+
+		// closes the file
+		Audio.set_player(_audio, nullptr, nullptr);
+
+		_audio = nullptr;
+
+		std::string *path = new std::string(_filename);
+		if (!IoPool || iopool_post(IoPool, 0, record_size, path)) {
+			record_size(path);
+		}
+	}
+}
+
+void Record::event_vad(Session*, bool vad) {
+	if (_max_silence > 0) {
+		if (vad) {
+			wtmr_cancel(&_tmr_max_silence);
+		}
+		else {
+			wtmr_start(&_tmr_max_silence, _max_silence, record_timer, &_timer_max_silence_id);
+		}
+	}
+}
+
+void Record::event_dtmf(Session *session, char, bool end)
+{
+	if (!end && _dtmf_stop) {
+		SLOG(SLOG_SCHED, SLOG_INFO, "%s recording %s stopped. Reason: dtmf\n", session->_id.c_str(), _filename.c_str());
+
+		stop();
+		session->_queue.schedule(VQueue::sched_end_of_file);
+	}
+}
+
+Record& Record::operator=(const Record& other) {
+
+	stop();
+
+	_session = other._session;
+	_stopped = false;
+	_filename = other._filename;
+	_max_silence = other._max_silence;
+	_max_length = other._max_length;
+	_length = 0;
+	_dtmf_stop = other._dtmf_stop;
+
+	return *this;
+}
+
+std::string Record::desc() const {
+	std::stringstream s;
+	s << "record " << _filename << " max_silence: " << _max_silence << " max_length: " <<  _max_length;
+	return s.str();
+}
+
+#pragma mark VQueue
+
+void Trace::add(uint8_t reason, trace_action action, const Molecule *m, uint32_t position) {
+
+	if (!_entries) {
+		_size = TraceSize;
+		_entries.reset(new TraceEntry[_size]);
+	}
+
+	TraceEntry &e = _entries[_count++ % _size];
+
+	e.time = tmr_jiffies_usec();
+	e.position = position;
+	e.reason = reason;
+	e.action = action;
+
+	if (m) {
+		size_t l = std::min(m->_id.size(), sizeof(e.token) - 1);
+		memcpy(e.token, m->_id.data(), l);
+		e.token[l] = '\0';
+		e.started = m->_time_started;
+		e.atom = (int32_t)m->_current;
+		e.priority = (uint8_t)m->_priority;
+	}
+	else {
+		e.token[0] = '\0';
+		e.started = 0;
+		e.atom = -1;
+		e.priority = 0;
 	}
+}
+
+// ms since the molecule started, for the trace
+static uint32_t played(const Molecule *m, size_t now) {
+	return m->_time_started ? (uint32_t)(now - m->_time_started) : 0;
+}
+
+int VQueue::schedule(reason r) {
+
+	size_t now = Audio.now();
+	uint64_t t0 = tmr_jiffies_usec();
+
+	Molecule *current = next();
+	if (!current) {
+		_trace.record(r, trace_idle, nullptr, 0);
+		_active = nullptr;
+		return 0;
+	}
+
+	// a molecule that was preempted plays again
+	bool resumed = current != _active && current->_time_started;
+
+	if (_active) {
+
+		// Just remove Molecules with m_discard that are interrupted
+		if (_active->_mode & m_discard && _active != current) {
+			_trace.record(r, trace_done, _active, played(_active, now));
+			discard(_active);
+		}
+		else if (_active == current) {
+			// The current molecule was stopped or played to the end
+
+			if (r == sched_end_of_file) {
+				++current->_current;
+				if (!current->is_active()) {
+					current->_time_stopped = now;
+				}
+			}
+			else {
+				current->_time_stopped = now;
+				current->set_position(now - current->_time_started);
+				_trace.record(r, trace_stop, current, played(current, now));
+			}
+		}
+		else {
+			// preempted, it resumes when current is done
+			_trace.record(r, trace_stop, _active, played(_active, now));
+		}
+	}
+
+	if (current->_mode & m_loop) {
+
+		if (current->_mode & m_restart && !current->is_active()) {
+			current->set_position(0);
+		}
+		else if (current->_mode & m_mute) {
+			size_t length = current->length();
+			size_t pos = current->_time_started && length ? (now - current->_time_started) % length : 0;
+			SLOG(SLOG_SCHED, SLOG_DEBUG, "setting position to %d\n", pos);
+			current->set_position(pos);
+		}
+		else if (current->_mode & m_pause) {
+			size_t pos = 0;
+			if (current->is_active()) {
+				size_t length = current->length();
+				pos = current->_time_stopped && length ? (current->_time_stopped - current->_time_started) % length : 0;
+			}
+			current->set_position(pos);
+		}
+	}
+
+	if (current->is_active()) {
+
+		Atom &a = current->current();
+		int err = a->start();
+		if (err) {
+			_trace.record(r, trace_fail, current, a->offset());
+			Metrics::count(Counters.atoms_failed);
+			SLOG(SLOG_SCHED, SLOG_WARN, "%s failed: %s\n", a->desc().c_str(), strerror(err));
+			current->_atoms.erase(current->_atoms.begin() + current->_current);
+			current->_current++;
+			return err;
+		}
+
+		if (current->_current == 0) {
+			current->_time_started = now;
+		}
+		_active = current;
+		_trace.record(r, trace_start, current, a->offset());
+		Metrics::count(Counters.atoms_started);
+		histogram_record_since(&Latency.command_audio, CommandArrived);
+		if (resumed) {
+			histogram_record_since(&Latency.resume_audio, t0);
+		}
+		_session->ring_event(EVR_ATOM, current->_current, a->offset());
+		SLOG(SLOG_SCHED, SLOG_DEBUG, "%s started\n", a->desc().c_str());
+
+		prefetch();
+	}
+	else {
+		// discard reports molecule_done for the active molecule
+		_trace.record(r, trace_done, current, played(current, now));
+		_active = current;
+		discard(current);
+
+		return schedule(r);
+	}
+
+	return 0;
+}
+
+int VQueue::enqueue(Molecule *m) {
+
+	if (!m->_id.empty()) {
+		_tokens.emplace(m->_id, m);
+	}
+
+	return insert(m);
+}
+
+void VQueue::defer(Molecule *m, uint64_t delay) {
+
+	if (!m->_id.empty()) {
+		_tokens.emplace(m->_id, m);
+	}
+
+	list_append(&_deferred, &m->_le, m);
+	++Queued.deferred;
+	m->_queue = this;
+
+	wtmr_start(&m->_tmr, delay, deferred_timer, m);
+}
+
+void VQueue::deferred_timer(void *arg) {
+
+	Molecule *m = (Molecule*)arg;
+
+	list_unlink(&m->_le);
+	--Queued.deferred;
+	m->_queue->insert(m);
+}
+
+int VQueue::insert(Molecule *m) {
+
+	list_append(&_lists[m->_priority], &m->_le, m);
+	++Queued.depths[m->_priority];
+	_nonempty |= 1ULL << m->_priority;
+
+	if (!_active || _active->_priority < m->_priority) {
+		if (_active) {
+			size_t now = Audio.now();
+
+			_active->_time_stopped = now;
+		}
+
+		return schedule(sched_interrupt);
+	}
+
+	return 0;
+}
+
+std::unordered_map<json_tcp*, Connection> Connections;
+
+// How long sessions survive the loss of their controller, in ms
+uint32_t GracePeriod = 0;
+// Number of events journaled per session
+uint32_t JournalSize = 64;
+// Number of scheduling decisions traced per session
+uint32_t TraceSize = 128;
+
+extern SessionTable Sessions;
+
+uint64_t Journal::stamp(struct odict *od) {
+
+	odict_entry_add(od, "seq", ODICT_INT, (int64_t)++_seq);
+
+	return _seq;
+}
+
+void Journal::append(uint64_t seq, struct mbuf *json) {
+
+	if (!JournalSize) {
+		return;
+	}
+
+	if (_entries.size() >= JournalSize) {
+		_entries.pop_front();
+	}
+
+	_entries.push_back(Entry{ seq, mbuf_ptr((mbuf*)mem_ref(json)) });
+}
+
+Session::Session(struct call *call, struct json_tcp *jt) : _call(call), _jt(jt), _queue(this) {
+	_id = call_id(call);
+	tmr_init(&_tmr_grace);
+}
+
+Session::Session(std::string_view id) : _id(id), _call(nullptr), _jt(nullptr), _queue(this) {
+	tmr_init(&_tmr_grace);
+}
+
+// Subscriptions of a controller connection
+bool subscribed(json_tcp *jt, event_type type) {
+
+	auto cit = Connections.find(jt);
+	if (cit == Connections.end()) {
+		return ev_default & type;
+	}
+
+	return cit->second._events & type;
+}
+
+bool Session::wants(event_type type) const {
+
+	if (_events) {
+		return *_events & type;
+	}
+
+	return subscribed(_jt, type);
+}
+
+void Session::send_event(odict *od, json_tcp_class cls, const char *key) {
+
+	Metrics::count(Counters.events);
+
+	uint64_t seq = _journal.stamp(od);
+	uint64_t t0 = tmr_jiffies_usec();
+
+	// the journal and the connection share the encoded frame
+	mbuf *json = mbuf_alloc(512);
+
+	if (json && !json_tcp_encode(json, od)) {
+		deliver(seq, json, cls, key, t0);
+	}
+
+	mem_deref(json);
+	mem_deref(od);
+}
+
+void Session::deliver(uint64_t seq, mbuf *json, json_tcp_class cls, const char *key, uint64_t t0) {
+
+	_journal.append(seq, json);
+
+	if (_jt) {
+		json_tcp_send_encoded(_jt, json, cls, key, t0);
+	}
+}
+
+void Session::molecule_done(const Molecule& m) {
+
+	if (!m._id.empty() && wants(ev_molecule_done)) {
+		odict *od = nullptr;
+		odict_alloc(&od, DICT_BSIZE);
+
+		odict_entry_add(od, "event", ODICT_BOOL, true);
+		odict_entry_add(od, "type", ODICT_STRING, "molecule_done");
+		odict_entry_add(od, "id", ODICT_STRING, _id.c_str());
+		odict_entry_add(od, "token", ODICT_STRING, m._id.c_str());
+
+		send_event(od);
+	}
+}
+
+void Session::ring_event(event_ring_type type, int32_t value, int32_t value2) const {
+
+	auto cit = Connections.find(_jt);
+	if (cit != Connections.end() && cit->second._ring) {
+		event_ring_push(cit->second._ring.get(), type, _id.c_str(), value, value2);
+	}
+}
+
+void Session::dtmf(char key) {
+
+	bool end = key == '\x04'; // end-of-transmission
+
+	if (!end) {
+		char k[2] = { key, 0 };
+		_dtmf = k;
+		_dtmf_start = std::chrono::system_clock::now();
+	}
+
+	ring_event(EVR_DTMF, _dtmf.empty() ? 0 : _dtmf[0], !end);
+
+	Molecule *active = _queue._active;
+	if (active && active->is_active()) {
+		active->current()->event_dtmf(this,_dtmf[0], end);
+	}
+
+	if (wants(end ? ev_dtmf_end : ev_dtmf_begin)) {
+		odict *od;
+		odict_alloc(&od, DICT_BSIZE);
+
+		odict_entry_add(od, "event", ODICT_BOOL, true);
+		odict_entry_add(od, "id", ODICT_STRING, _id.c_str());
+		odict_entry_add(od, "type", ODICT_STRING, end ? "dtmf_end" : "dtmf_begin");
+		odict_entry_add(od, "key", ODICT_STRING, _dtmf.c_str());
+
+		if (end) {
+			auto now = std::chrono::system_clock::now();
+
+			auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now - _dtmf_start);
+			odict_entry_add(od, "duration", ODICT_INT, (int64_t)duration.count());
+		}
+
+		send_event(od);
+	}
+
+	if (end) {
+		_dtmf.erase();
+	}
+}
+
+void Session::hangup(int16_t scode, const char* reason) {
+	if (_call) {
+		call_hangup(_call, scode , reason);
+		_call = nullptr;
+
+		if (!wants(ev_call_closed)) {
+			return;
+		}
+
+		odict *od;
+		odict_alloc(&od, DICT_BSIZE);
+
+		odict_entry_add(od, "event", ODICT_BOOL, true);
+		odict_entry_add(od, "type", ODICT_STRING, "call_closed");
+		odict_entry_add(od, "status_code", ODICT_INT, scode);
+		odict_entry_add(od, "reason", ODICT_STRING, reason);
+		odict_entry_add(od, "id", ODICT_STRING, _id.c_str());
+
+		send_event(od);
+	}
+}
+
+Session::~Session() {
+	tmr_cancel(&_tmr_grace);
+	hangup();
+
+	drop_backlog();
+}
+
+void Session::drop_backlog() {
+
+	if (auto cit = Connections.find(_jt); _jt && cit != Connections.end()) {
+		cit->second._backlogged -= _backlog.size();
+	}
+
+	_backlog.clear();
+}
+
+// A call that was offered to a controller, but not yet answered
+struct PendingCall {
+	struct call *call;
+	struct json_tcp *owner;
+};
+
+Session *SessionTable::insert(struct call *call, struct json_tcp *jt) {
+
+	uint32_t index;
+
+	if (_free.empty()) {
+		index = _slots.size();
+		_slots.emplace_back();
+	}
+	else {
+		index = _free.back();
+		_free.pop_back();
+	}
+
+	Session &session = _slots[index].session.emplace(call, jt);
+	session._handle = handle(index);
+	_slots[index].call = call;
+
+	_by_id.insert(std::make_pair(std::string_view(session._id), index));
+	_by_call.insert(std::make_pair(call, index));
+
+	++Queued.sessions;
+	if (!jt) {
+		++Queued.orphans;
+	}
+
+	return &session;
+}
+
+void SessionTable::erase(Session *session) {
+
+	uint32_t index = session->_handle & ((1 << index_bits) - 1);
+	Slot &slot = _slots[index];
+
+	_by_id.erase(session->_id);
+	_by_call.erase(slot.call);
+	slot.call = nullptr;
+
+	--Queued.sessions;
+	if (!session->_jt) {
+		--Queued.orphans;
+	}
+
+	// the destructor may still send events
+	slot.session.reset();
+	if (++slot.generation > generation_max) {
+		slot.generation = 1;
+	}
+	_free.push_back(index);
+}
+
+Session *SessionTable::find(SessionHandle h) {
+
+	uint32_t index = h & ((1 << index_bits) - 1);
+
+	if (index >= _slots.size() || handle(index) != h) {
+		return nullptr;
+	}
+
+	return at(index);
+}
+
+Session *SessionTable::find(std::string_view call_id) {
+
+	auto it = _by_id.find(call_id);
+
+	return it == _by_id.end() ? nullptr : at(it->second);
+}
+
+Session *SessionTable::find(struct call *call) {
+
+	auto it = _by_call.find(call);
+
+	return it == _by_call.end() ? nullptr : at(it->second);
+}
+
+SessionTable Sessions;
+// User agents and the controller connection that owns them (listened on them)
+std::unordered_map<ua*, json_tcp*> UserAgents;
+std::unordered_map<std::string, PendingCall> PendingCalls;
+
+// A molecule prototype and the connection that defined it
+struct Template {
+	MoleculePtr molecule;
+	json_tcp *owner;
+};
+
+// Molecule prototypes by name, shared by all connections. Only the owner
+// can redefine a template while it is connected
+std::unordered_map<std::string, Template> Templates;
+
+// No controller resumed the session in time
+void session_grace_timeout(void *arg) {
+
+	Session *session = (Session*)arg;
+
+	warning("%s: not resumed within %u ms, hanging up\n", session->_id.c_str(), GracePeriod);
+
+	session->hangup(500, "Connection to world lost");
+	Sessions.erase(session);
+}
+
+void Session::orphan(uint32_t grace) {
+
+	// the frames of the lost controller
+	drop_backlog();
+	if (_jt) {
+		++Queued.orphans;
+	}
+	_jt = nullptr;
+	tmr_start(&_tmr_grace, grace, session_grace_timeout, this);
+}
+
+void Session::adopt(struct json_tcp *jt) {
+
+	tmr_cancel(&_tmr_grace);
+	if (!_jt) {
+		--Queued.orphans;
+	}
+	_jt = jt;
+}
+
+const struct {
+	const char *name;
+	event_type type;
+} EventNames[] = {
+	{ "call_incoming", ev_call_incoming },
+	{ "call_closed", ev_call_closed },
+	{ "dtmf_begin", ev_dtmf_begin },
+	{ "dtmf_end", ev_dtmf_end },
+	{ "molecule_done", ev_molecule_done },
+	{ "vad", ev_vad },
+	{ "ua", ev_ua },
+	{ "default", ev_default },
+	{ "all", ev_all }
+};
+
+#pragma mark Metrics
+
+enum { lag_interval = 100, rate_window = 1000 };
+
+// Event loop lag and the rates of the counters, sampled on the main loop
+struct LoopMonitor {
+	struct tmr tmr;
+	uint64_t expected = 0;
+	// in ms, of the last tick and since the module was loaded
+	uint64_t lag = 0;
+	uint64_t max_lag = 0;
+	// the counters at the start of the rate window
+	uint64_t window = 0;
+	uint64_t commands = 0;
+	uint64_t events = 0;
+	double command_rate = 0;
+	double event_rate = 0;
+} Loop;
+
+static void lag_tick(void *arg) {
+	(void)arg;
+
+	uint64_t now = tmr_jiffies();
+
+	Loop.lag = now > Loop.expected ? now - Loop.expected : 0;
+	Loop.max_lag = std::max(Loop.max_lag, Loop.lag);
+
+	recover_main_jobs();
+
+	if (now - Loop.window >= rate_window) {
+		double seconds = (now - Loop.window) / 1000.0;
+		uint64_t commands = Counters.commands.load(std::memory_order_relaxed);
+		uint64_t events = Counters.events.load(std::memory_order_relaxed);
+
+		Loop.command_rate = (commands - Loop.commands) / seconds;
+		Loop.event_rate = (events - Loop.events) / seconds;
+		Loop.window = now;
+		Loop.commands = commands;
+		Loop.events = events;
+	}
+
+	Loop.expected = now + lag_interval;
+	tmr_start(&Loop.tmr, lag_interval, lag_tick, nullptr);
+}
+
+// The state of the queues, collected for villa_status and stats
+struct QueueStats {
+	size_t sessions = 0;
+	size_t orphans = 0;
+	// molecules per priority, of all sessions
+	std::vector<size_t> depths;
+	size_t deferred = 0;
+};
+
+static void collect_queue_stats(QueueStats &qs) {
+
+	qs.sessions = Queued.sessions;
+	qs.orphans = Queued.orphans;
+	qs.depths.assign(Queued.depths, Queued.depths + Priorities);
+	qs.deferred = Queued.deferred;
+}
+
+// count, p50, p99, p999 and max in µs
+static odict *latency_dict(const histogram &h) {
+
+	odict *od = nullptr;
+	odict_alloc(&od, DICT_BSIZE);
+
+	odict_entry_add(od, "count", ODICT_INT, (int64_t)h.n);
+	odict_entry_add(od, "p50", ODICT_INT, (int64_t)histogram_percentile(&h, 0.5));
+	odict_entry_add(od, "p99", ODICT_INT, (int64_t)histogram_percentile(&h, 0.99));
+	odict_entry_add(od, "p999", ODICT_INT, (int64_t)histogram_percentile(&h, 0.999));
+	odict_entry_add(od, "max", ODICT_INT, (int64_t)h.max);
+
+	return od;
+}
+
+static int print_latency(struct re_printf *pf, const char *name, const histogram &h) {
+
+	return re_hprintf(pf, "  %s: %llu, p50 %.1f ms, p99 %.1f ms, p999 %.1f ms, max %.1f ms\n",
+		name, (unsigned long long)h.n,
+		histogram_percentile(&h, 0.5) / 1000.0, histogram_percentile(&h, 0.99) / 1000.0,
+		histogram_percentile(&h, 0.999) / 1000.0, h.max / 1000.0);
+}
+
+static double asset_hit_rate() {
+
+	uint64_t hits = Counters.asset_hits.load(std::memory_order_relaxed);
+	uint64_t misses = Counters.asset_misses.load(std::memory_order_relaxed);
+
+	return hits + misses ? 100.0 * hits / (hits + misses) : 0;
+}
+
+// A copy of the metrics, taken on the main thread and rendered on the
+// I/O pool, so a scrape doesn't hold up the calls
+struct MetricsSnapshot {
+	QueueStats queues;
+	struct json_tcp_stats io;
+	size_t pending_calls;
+	size_t assets;
+	uint64_t prefetched;
+	uint64_t prefetch_skipped;
+	uint64_t commands;
+	uint64_t events;
+	uint64_t atoms_started;
+	uint64_t atoms_failed;
+	uint64_t record_bytes;
+	uint64_t asset_hits;
+	uint64_t asset_misses;
+	uint64_t loop_lag;
+	uint64_t max_loop_lag;
+	histogram command_audio;
+	histogram resume_audio;
+	histogram event_wire;
+};
+
+static void take_snapshot(MetricsSnapshot &s) {
+
+	auto counter = [](const std::atomic<uint64_t> &c) {
+		return c.load(std::memory_order_relaxed);
+	};
+
+	collect_queue_stats(s.queues);
+	json_tcp_totals(&s.io);
+	s.pending_calls = PendingCalls.size();
+	s.assets = Assets.size();
+	s.prefetched = Prefetch.issued;
+	s.prefetch_skipped = Prefetch.skipped;
+	s.commands = counter(Counters.commands);
+	s.events = counter(Counters.events);
+	s.atoms_started = counter(Counters.atoms_started);
+	s.atoms_failed = counter(Counters.atoms_failed);
+	s.record_bytes = counter(Counters.record_bytes);
+	s.asset_hits = counter(Counters.asset_hits);
+	s.asset_misses = counter(Counters.asset_misses);
+	s.loop_lag = Loop.lag;
+	s.max_loop_lag = Loop.max_lag;
+	s.command_audio = Latency.command_audio;
+	s.resume_audio = Latency.resume_audio;
+	s.event_wire = Latency.event_wire;
+}
+
+// Bucket bounds of the exported latency histograms
+static const struct {
+	uint64_t us;
+	const char *le;
+} latency_buckets[] = {
+	{ 500, "0.0005" }, { 1000, "0.001" }, { 2500, "0.0025" }, { 5000, "0.005" },
+	{ 10000, "0.01" }, { 25000, "0.025" }, { 50000, "0.05" }, { 100000, "0.1" },
+	{ 250000, "0.25" }, { 500000, "0.5" }, { 1000000, "1.0" }, { 2500000, "2.5" },
+	{ 5000000, "5.0" }, { 10000000, "10.0" }
+};
+
+static int print_counter(mbuf *mb, const char *name, const char *help, uint64_t value) {
+
+	return mbuf_printf(mb, "# TYPE villa_%s counter\n# HELP villa_%s %s\nvilla_%s_total %llu\n",
+		name, name, help, name, (unsigned long long)value);
+}
+
+static int print_gauge(mbuf *mb, const char *name, const char *help, uint64_t value) {
+
+	return mbuf_printf(mb, "# TYPE villa_%s gauge\n# HELP villa_%s %s\nvilla_%s %llu\n",
+		name, name, help, name, (unsigned long long)value);
+}
+
+static int print_seconds(mbuf *mb, const char *name, const char *help, uint64_t ms) {
+
+	return mbuf_printf(mb, "# TYPE villa_%s_seconds gauge\n# HELP villa_%s_seconds %s\nvilla_%s_seconds %.3f\n",
+		name, name, help, name, ms / 1e3);
+}
+
+static int print_histogram(mbuf *mb, const char *name, const char *help, const histogram &h) {
+
+	int err = mbuf_printf(mb, "# TYPE villa_%s_seconds histogram\n# HELP villa_%s_seconds %s\n",
+		name, name, help);
+
+	for (auto &b : latency_buckets) {
+		err |= mbuf_printf(mb, "villa_%s_seconds_bucket{le=\"%s\"} %llu\n",
+			name, b.le, (unsigned long long)histogram_count_le(&h, b.us));
+	}
+
+	err |= mbuf_printf(mb, "villa_%s_seconds_bucket{le=\"+Inf\"} %llu\n"
+		"villa_%s_seconds_sum %.6f\nvilla_%s_seconds_count %llu\n",
+		name, (unsigned long long)h.n, name, h.sum / 1e6, name, (unsigned long long)h.n);
+
+	return err;
+}
+
+// OpenMetrics text format, see https://openmetrics.io
+static int render_openmetrics(mbuf *mb, const MetricsSnapshot &s) {
+
+	int err = 0;
+
+	err |= print_counter(mb, "commands", "Commands received", s.commands);
+	err |= print_counter(mb, "events", "Events sent", s.events);
+	err |= print_counter(mb, "frames_in", "Frames received on the control connections", s.io.n_rx);
+	err |= print_counter(mb, "bytes_in", "Bytes received on the control connections", s.io.bytes_rx);
+	err |= print_counter(mb, "frames_out", "Frames sent on the control connections", s.io.n_tx);
+	err |= print_counter(mb, "bytes_out", "Bytes sent on the control connections", s.io.bytes_tx);
+	err |= print_counter(mb, "atoms_started", "Atoms started", s.atoms_started);
+	err |= print_counter(mb, "atoms_failed", "Atoms that failed to start", s.atoms_failed);
+	err |= print_counter(mb, "record_bytes", "Bytes recorded", s.record_bytes);
+	err |= print_counter(mb, "asset_hits", "Asset lengths that were known", s.asset_hits);
+	err |= print_counter(mb, "asset_misses", "Asset lengths that were looked up", s.asset_misses);
+	err |= print_counter(mb, "prefetched", "Assets prefetched", s.prefetched);
+	err |= print_counter(mb, "prefetch_over_budget", "Prefetches skipped over the rate", s.prefetch_skipped);
+
+	err |= print_gauge(mb, "sessions", "Sessions", s.queues.sessions);
+	err |= print_gauge(mb, "orphans", "Sessions without a controller", s.queues.orphans);
+	err |= print_gauge(mb, "pending_calls", "Incoming calls not yet claimed", s.pending_calls);
+	err |= print_gauge(mb, "deferred", "Deferred molecules", s.queues.deferred);
+	err |= print_gauge(mb, "assets", "Known assets", s.assets);
+	err |= print_seconds(mb, "loop_lag", "Lag of the event loop", s.loop_lag);
+	err |= print_seconds(mb, "max_loop_lag", "Largest lag of the event loop", s.max_loop_lag);
+
+	err |= mbuf_printf(mb, "# TYPE villa_queue_depth gauge\n# HELP villa_queue_depth Molecules per priority\n");
+	for (size_t p = 0; p < s.queues.depths.size(); ++p) {
+		err |= mbuf_printf(mb, "villa_queue_depth{priority=\"%zu\"} %zu\n", p, s.queues.depths[p]);
+	}
+
+	err |= print_histogram(mb, "command_to_audio", "From reading a command until its atom starts", s.command_audio);
+	err |= print_histogram(mb, "resume_to_audio", "From scheduling until a preempted molecule starts again", s.resume_audio);
+	err |= print_histogram(mb, "event_to_wire", "From sending an event until it is handed to the socket", s.event_wire);
+
+	err |= mbuf_printf(mb, "# EOF\n");
+
+	return err;
+}
+
+struct http_sock *MetricsSock = nullptr;
+
+struct ScrapeJob : MainJob {
+	http_conn *conn;
+	MetricsSnapshot snapshot;
+	mbuf *text;
+	int err;
+};
+
+// Runs on the main thread
+static void scrape_reply(void *arg) {
+
+	std::unique_ptr<ScrapeJob> job((ScrapeJob*)arg);
+
+	if (job->err) {
+		http_ereply(job->conn, 500, "Internal Server Error");
+	}
+	else {
+		http_creply(job->conn, 200, "OK",
+			"application/openmetrics-text; version=1.0.0; charset=utf-8",
+			"%b", job->text->buf, job->text->end);
+	}
+
+	mem_deref(job->text);
+	mem_deref(job->conn);
+}
+
+// Runs on the I/O pool, or the main thread without one
+static void scrape_render(void *arg) {
+
+	ScrapeJob *job = (ScrapeJob*)arg;
+
+	job->text = mbuf_alloc(8192);
+	job->err = job->text ? render_openmetrics(job->text, job->snapshot) : ENOMEM;
+
+	if (!IoPool) {
+		scrape_reply(job);
+		return;
+	}
+
+	post_main(IoPool, job, scrape_reply, "a metrics scrape");
+}
+
+static void metrics_request(http_conn *conn, const http_msg *msg, void *arg) {
+	(void)arg;
+
+	if (pl_strcmp(&msg->met, "GET")) {
+		http_ereply(conn, 405, "Method Not Allowed");
+		return;
+	}
+
+	if (pl_strcmp(&msg->path, "/metrics")) {
+		http_ereply(conn, 404, "Not Found");
+		return;
+	}
+
+	ScrapeJob *job = new ScrapeJob();
+	job->conn = (http_conn*)mem_ref(conn);
+	take_snapshot(job->snapshot);
+
+	if (!IoPool) {
+		scrape_render(job);
+		return;
+	}
+
+	int err = iopool_post(IoPool, 0, scrape_render, job);
+	if (err) {
+		warning("villa: failed to post a metrics scrape (%m)\n", err);
+		http_ereply(conn, 503, "Service Unavailable");
+		mem_deref(job->conn);
+		delete job;
+	}
+}
+
+odict *create_response(const char* type, const char* token, int result, const char* message=nullptr)
+{
+	odict *od = nullptr;
+	odict_alloc(&od, DICT_BSIZE);
+
+	odict_entry_add(od, "type", ODICT_STRING, type);
+	odict_entry_add(od, "class", ODICT_STRING, "villa");
+	odict_entry_add(od, "response", ODICT_BOOL, true);
+	if (token) {
+		odict_entry_add(od, "token", ODICT_STRING, token);
+	}
+	odict_entry_add(od, "result", ODICT_INT, result);
+	if (message) {
+		odict_entry_add(od, "message", ODICT_STRING, message);
+	}
+
+	return od;
+}
+
+extern "C" {
+
+	void villa_queue_config(uint32_t priorities)
+	{
+		if (priorities < 1 || priorities > max_priorities) {
+			warning("villa: %u priorities out of range, using %u\n",
+				priorities, Priorities);
+			return;
+		}
+
+		Priorities = priorities;
+	}
+
+	void villa_session_config(uint32_t grace_period, uint32_t journal_size, uint32_t trace_size)
+	{
+		GracePeriod = grace_period;
+		JournalSize = journal_size;
+		TraceSize = trace_size;
+	}
+
+	void villa_io_close()
+	{
+		IoPool = (struct iopool*)mem_deref(IoPool);
+	}
+
+	void villa_prefetch_config(uint32_t atoms, uint32_t rate)
+	{
+		PrefetchAtoms = atoms;
+		PrefetchRate = (uint64_t)rate << 10;
+	}
+
+	void villa_preload_config(const char *manifest)
+	{
+		StartupPreload = preload({}, manifest);
+	}
+
+	void villa_preload_close()
+	{
+		// joins the threads, they skip the jobs left in their queues
+		PreloadClosing = true;
+		PreloadPool = (struct iopool*)mem_deref(PreloadPool);
+		PreloadClosing = false;
+
+		// their waiters are dropped, the connections are gone
+		while (!Preloads.empty()) {
+			preload_free(*Preloads.begin());
+		}
+		StartupPreload = nullptr;
+	}
+
+	int villa_io_config(uint32_t threads)
+	{
+		if (!threads) {
+			return 0;
+		}
+
+		int err = iopool_alloc(&IoPool, threads);
+		if (err) {
+			warning("villa: failed to start %u I/O threads (%m)\n", threads, err);
+		}
+
+		return err;
+	}
+
+	void villa_tcp_disconnected(struct json_tcp *jt)
+	{
+		// Lost connection to a world. Its sessions keep playing for the
+		// grace period, unless another connection resumes them
+		for (size_t i = 0; i < Sessions.slots(); ++i) {
+			Session *session = Sessions.at(i);
+			if (!session || session->_jt != jt) {
+				continue;
+			}
+
+			if (GracePeriod) {
+				session->orphan(GracePeriod);
+			}
+			else {
+				session->hangup(500, "Connection to world lost");
+				Sessions.erase(session);
+			}
+		}
+
+		for (auto cit = PendingCalls.begin(); cit != PendingCalls.end();) {
+			if (cit->second.owner == jt) {
+				call_hangup(cit->second.call, 500, "Connection to world lost");
+				cit = PendingCalls.erase(cit);
+			}
+			else {
+				++cit;
+			}
+		}
+
+		Connections.erase(jt);
+
+		// Keep the user agents registered, but allow another world to claim them
+		for (auto &[agent, owner] : UserAgents) {
+			if (owner == jt) {
+				owner = nullptr;
+			}
+		}
+
+		// Likewise the templates
+		for (auto &[name, t] : Templates) {
+			if (t.owner == jt) {
+				t.owner = nullptr;
+			}
+		}
+	}
+
+	void villa_call_event_handler(struct call *call, enum call_event ev,
+			    const char *str, void *arg)
+	{
+		Session *session = Sessions.find((SessionHandle)arg);
+
+		switch (ev) {
+			case CALL_EVENT_CLOSED:
+			{
+				if (session) {
+
+					SLOG(SLOG_CALL, SLOG_INFO, "%s CALL_CLOSED\n", session->_id.c_str());
+
+					session->hangup(200, str);
+					Sessions.erase(session);
+				}
+				else {
+					SLOG(SLOG_CALL, SLOG_INFO, "%s CALL_CLOSED, but no session found\n",
+						call_id(call));
+				}
+			}
+			break;
+		default:
+			break;
+		}
+
+		SLOG(SLOG_CALL, SLOG_DEBUG, "received call event: %s\n", call_event_name(ev));
+	}
+
+	void villa_dtmf_handler(struct call *call, char key, void *arg)
+	{
+		Session *session = Sessions.find((SessionHandle)arg);
+		if (!session) {
+			SLOG(SLOG_CALL, SLOG_INFO, "%s DTMF, but no session found\n", call_id(call));
+			return;
+		}
+
+		SLOG(SLOG_CALL, SLOG_DEBUG, "%s received DTMF event: key = '%c'\n", session->_id.c_str(), key ? key : '.');
+
+		session->dtmf(key);
+	}
+
+	void villa_event_handler(struct ua *ua, enum ua_event ev,
+		struct call *call, const char *prm, void *arg)
+	{
+		(void)arg;
+		struct json_tcp *jt = nullptr;
+		bool send_event = false;
+
+		switch (ev) {
+
+		case UA_EVENT_CALL_INCOMING:
+		{
+			std::string cid(call_id(call));
+			SLOG(SLOG_CALL, SLOG_INFO, "%s: CALL_INCOMING: peer=%s --> local=%s\n",
+				cid.c_str(), call_peeruri(call), call_localuri(call));
+
+			// Offer the call to the world that listens on the user agent
+			auto uit = UserAgents.find(ua);
+			if (uit == UserAgents.end()) {
+				warning("%s CALL_INCOMING: %s is not a villa user agent\n",
+					cid.c_str(), call_localuri(call));
+				return;
+			}
+
+			// The controller is gone, don't let the call ring until the
+			// caller gives up
+			if (!uit->second) {
+				warning("%s CALL_INCOMING: no controller owns %s, rejecting\n",
+					cid.c_str(), call_localuri(call));
+				call_hangup(call, 480, "Temporarily Unavailable");
+				return;
+			}
+
+			jt = uit->second;
+			PendingCalls.insert(std::make_pair(cid, PendingCall{ call, jt }));
+			send_event = subscribed(jt, ev_call_incoming);
+			break;
+		}
+		case UA_EVENT_CALL_CLOSED:
+		{
+			// Answered calls report this via villa_call_event_handler
+			auto cit = PendingCalls.find(call_id(call));
+			if (cit == PendingCalls.end()) {
+				return;
+			}
+
+			SLOG(SLOG_CALL, SLOG_INFO, "%s CALL_CLOSED before answered: %s\n", call_id(call), prm);
+
+			jt = cit->second.owner;
+			PendingCalls.erase(cit);
+			send_event = subscribed(jt, ev_call_closed);
+			break;
+		}
+		case UA_EVENT_END_OF_FILE:
+		{
+			SLOG(SLOG_CALL, SLOG_DEBUG, "%s END_OF_FILE\n", call_id(call));
+
+			size_t now = Audio.now();
+
+			Session *session = Sessions.find(call);
+			if (!session) {
+				warning("%s END_OF_FILE: no session found\n", call_id(call));
+				return;
+			}
+
+			if (session->_queue._active) {
+				Molecule *stopped = session->_queue._active;
+				stopped->_time_stopped = now;
+
+				session->_queue.schedule(VQueue::sched_end_of_file);
+			}
+			else {
+				warning("villa: no molecule active, but UA_EVENT_END_OF_FILE received");
+			}
+
+			break;
+		}
+		case UA_EVENT_MODULE:
+		{
+			SLOG(SLOG_CALL, SLOG_DEBUG, "%s MODULE %s\n", call_id(call), prm);
+
+			Session *session = Sessions.find(call);
+			if (!session) {
+				SLOG(SLOG_CALL, SLOG_DEBUG, "%s MODULE: no session found\n", call_id(call));
+				return;
+			}
+
+			// module,event,data
+			std::string_view elems[3];
+			std::string_view p(prm ? prm : "");
+			size_t n = 0;
+
+			for (; n < 3 && !p.empty(); ++n) {
+				size_t comma = p.find(',');
+				elems[n] = p.substr(0, comma);
+				p = comma == p.npos ? std::string_view() : p.substr(comma + 1);
+			}
+
+			if (n >= 3) {
+				if (elems[0] == "fvad" && elems[1] == "vad_rx") {
+					bool vad = elems[2] == "on";
+
+					session->_vad = vad;
+					session->ring_event(EVR_VAD, vad);
+
+					if (session->wants(ev_vad)) {
+						odict *od = nullptr;
+						odict_alloc(&od, DICT_BSIZE);
+
+						odict_entry_add(od, "event", ODICT_BOOL, true);
+						odict_entry_add(od, "type", ODICT_STRING, "vad");
+						odict_entry_add(od, "id", ODICT_STRING, session->_id.c_str());
+						odict_entry_add(od, "active", ODICT_BOOL, vad);
+
+						// Only the latest VAD state matters to a slow controller
+						std::string key("vad:" + session->_id);
+						session->send_event(od, JSON_TCP_COALESCE, key.c_str());
+					}
+
+					Molecule *active = session->_queue._active;
+					if (active && active->is_active()) {
+						active->current()->event_vad(session, vad);
+					}
+				}
+			}
+			else {
+				warning("unknown event format '%s\n", prm);
+			}
+			break;
+		}
+		default:
+		{
+			// Forward other user agent events only if subscribed
+			auto uit = UserAgents.find(ua);
+			if (uit == UserAgents.end() || !uit->second) {
+				return;
+			}
+
+			jt = uit->second;
+			send_event = subscribed(jt, ev_ua);
+			break;
+		}
+		}
+
+		if (send_event) {
+
+			struct odict *od = NULL;
+
+			int err = odict_alloc(&od, DICT_BSIZE);
+			if (err)
+				return;
+
+			err = odict_entry_add(od, "event", ODICT_BOOL, true);
+			err |= event_encode_dict(od, ua, ev, call, prm);
+			if (err) {
+				SLOG(SLOG_VILLA, SLOG_WARN, "failed to encode event (%m)\n", err);
+				mem_deref(od);
+				return;
+			}
+
+			// Call events are critical, other user agent events may be dropped
+			Metrics::count(Counters.events);
+			json_tcp_send_event(jt, od, call ? JSON_TCP_CRITICAL : JSON_TCP_DROPPABLE, nullptr);
+		}
+	}
+
+	// Sets CommandArrived while a command is executed or completed
+	struct CommandClock {
+		CommandClock(uint64_t arrived) : _saved(CommandArrived) {
+			CommandArrived = arrived;
+		}
+		~CommandClock() {
+			CommandArrived = _saved;
+		}
+		uint64_t _saved;
+	};
+
+	// s as a quoted JSON string
+	static void append_json_string(std::string &out, std::string_view s) {
+
+		out += '"';
+		for (char c : s) {
+			switch (c) {
+			case '"':
+				out += "\\\"";
+				break;
+			case '\\':
+				out += "\\\\";
+				break;
+			default:
+				if ((unsigned char)c < 0x20) {
+					char u[8];
+					re_snprintf(u, sizeof(u), "\\u%04x", (unsigned)c);
+					out += u;
+				}
+				else {
+					out += c;
+				}
+			}
+		}
+		out += '"';
+	}
+
+	// A command frame. params is positioned inside the params array
+	struct Command {
+
+		Command(const char *name, const char *token, char *params, char *end, struct json_tcp *jt)
+			: _name(name), _token(token), _params(params ? params : end, end), _jt(jt) {
+			_has_params = params && _params.enter_array();
+		}
+
+		// true if another parameter follows
+		bool more() {
+			return _has_params && _params.more();
+		}
+
+		odict *response(int result, const char *message = nullptr) const {
+			return create_response(_name, _token, result, message);
+		}
+
+		// log and create an error response for the current parameter
+		odict *invalid(const char *what, const char *problem, int err = EINVAL) const {
+			char message[128];
+			re_snprintf(message, sizeof(message), "parameter %d (%s) %s", _count, what, problem);
+			warning("command %s: %s\n", _name, message);
+			return response(err, message);
+		}
+
+		// The next parameter. Returns nullptr or the error response
+		odict *string(const char *&s, const char *what) {
+			++_count;
+			if (!more()) {
+				return invalid(what, "missing");
+			}
+			if (_params.peek() != j_string || !_params.string(s)) {
+				return invalid(what, "has invalid type");
+			}
+			return nullptr;
+		}
+
+		odict *integer(int64_t &i, const char *what) {
+			++_count;
+			if (!more()) {
+				return invalid(what, "missing");
+			}
+			if (_params.peek() != j_number || !_params.number(i)) {
+				return invalid(what, "has invalid type");
+			}
+			return nullptr;
+		}
+
+		const char *_name;
+		const char *_token;
+		JsonReader _params;
+		struct json_tcp *_jt;
+		bool _has_params;
+		int _count = 0;
+		// The command as a frame again, to run it later: the call id that
+		// was read and the parameters that were not. Empty if they are
+		// malformed. Decoding modified the original frame in place
+		std::string reframe(const char *call_id) const {
+
+			JsonReader rest = _params;
+			while (rest.more() && rest.skip()) {
+			}
+			if (rest.error()) {
+				return {};
+			}
+
+			std::string frame = "{\"type\":";
+			append_json_string(frame, _name);
+			if (_token) {
+				frame += ",\"token\":";
+				append_json_string(frame, _token);
+			}
+			frame += ",\"params\":[";
+			append_json_string(frame, call_id);
+			frame.append(_params.pos(), rest.pos() - _params.pos());
+			frame += '}';
+
+			return frame;
+		}
+
+		// the frame waits for its session and runs later
+		bool _backlogged = false;
+	};
+
+	// Parse the remaining parameters as event names into a mask
+	odict *event_mask(Command &cmd, uint32_t &mask) {
+
+		mask = 0;
+
+		while (cmd.more()) {
+			const char *name;
+			if (odict *r = cmd.string(name, "event type")) {
+				return r;
+			}
+
+			bool found = false;
+
+			for (auto &en : EventNames) {
+				if (strcmp(en.name, name) == 0) {
+					mask |= en.type;
+					found = true;
+					break;
+				}
+			}
+
+			if (!found) {
+				warning("villa: unknown event type %s\n", name);
+				return cmd.response(EINVAL, "invalid event type");
+			}
+		}
+
+		return nullptr;
+	}
+
+	odict *command_frame(char *frame, size_t len, struct json_tcp *jt, uint64_t arrived, int *errp);
+	odict *run_frame(char *frame, size_t len, struct json_tcp *jt, uint64_t arrived, int *errp);
+
+	// Run the frames that arrived while a connection command waited for
+	// its assets
+	void replay_backlog(json_tcp *jt) {
+
+		for (;;) {
+			auto cit = Connections.find(jt);
+			if (cit == Connections.end() || cit->second._blocked || cit->second._backlog.empty()) {
+				return;
+			}
+
+			Backlogged b = std::move(cit->second._backlog.front());
+			cit->second._backlog.pop_front();
+			--cit->second._backlogged;
+
+			int err = 0;
+			odict *r = command_frame(b.frame.data(), b.frame.size(), jt, b.arrived, &err);
+			if (r) {
+				json_tcp_send(jt, r);
+			}
+			else if (err) {
+				warning("villa: dropped a malformed frame (%m)\n", err);
+			}
+		}
+	}
+
+	// Run the frames for a session that arrived while a command for it
+	// waited for its assets. They arrived before the frames that wait on
+	// the connection, so they don't wait for it
+	void replay_session(SessionHandle handle) {
+
+		for (;;) {
+			Session *session = Sessions.find(handle);
+			if (!session || session->_blocked || session->_backlog.empty()) {
+				return;
+			}
+
+			Backlogged b = std::move(session->_backlog.front());
+			session->_backlog.pop_front();
+
+			json_tcp *jt = session->_jt;
+			if (auto cit = Connections.find(jt); cit != Connections.end()) {
+				--cit->second._backlogged;
+			}
+
+			int err = 0;
+			odict *r = run_frame(b.frame.data(), b.frame.size(), jt, b.arrived, &err);
+			if (r) {
+				json_tcp_send(jt, r);
+			}
+			else if (err) {
+				warning("villa: dropped a malformed frame (%m)\n", err);
+			}
+		}
+	}
+
+	// Wait behind a command for the session that waits for its assets.
+	// call_id was read from the parameters of cmd
+	odict *backlog(Command &cmd, Session &session, const char *call_id) {
+
+		std::string frame = cmd.reframe(call_id);
+		if (frame.empty()) {
+			return cmd.response(EINVAL, "malformed parameters");
+		}
+
+		session._backlog.push_back({ CommandArrived, std::move(frame) });
+		++Connections[cmd._jt]._backlogged;
+		cmd._backlogged = true;
+
+		return nullptr;
+	}
+
+	using Resume = std::function<void()>;
+
+	// Complete the command once the returned function was called n times.
+	// If ordered, the later frames for the session, or of the connection
+	// without a session, wait until then
+	Resume defer_command(Command &cmd, size_t n, bool ordered, std::function<odict*(Command&)> complete,
+		Session *session = nullptr) {
+
+		Connection &conn = Connections[cmd._jt];
+		if (ordered && session) {
+			session->_blocked = true;
+		}
+		else if (ordered) {
+			conn._blocked = true;
+		}
+
+		auto pending = std::make_shared<size_t>(n);
+		std::string name(cmd._name);
+		std::optional<std::string> token;
+		if (cmd._token) {
+			token = cmd._token;
+		}
+
+		SessionHandle handle = session ? session->_handle : 0;
+
+		return [=, jt = cmd._jt, id = conn._id, arrived = CommandArrived]() {
+			if (--*pending) {
+				return;
+			}
+
+			// unless the controller is gone
+			auto cit = Connections.find(jt);
+			if (cit != Connections.end() && cit->second._id == id) {
+				static char end[] = "";
+				Command c(name.c_str(), token ? token->c_str() : nullptr, nullptr, end, jt);
+
+				CommandClock clock(arrived);
+				if (odict *r = complete(c)) {
+					json_tcp_send(jt, r);
+				}
+			}
+
+			if (!ordered) {
+				return;
+			}
+
+			// the session may have been adopted by another connection
+			if (handle) {
+				Session *s = Sessions.find(handle);
+				if (s && s->_blocked) {
+					s->_blocked = false;
+					replay_session(handle);
+				}
+				return;
+			}
+
+			cit = Connections.find(jt);
+			if (cit != Connections.end() && cit->second._id == id) {
+				cit->second._blocked = false;
+				replay_backlog(jt);
+			}
+		};
+	}
+
+	odict *command_ping(Command &cmd) {
+		// no-op for measuring the command round trip
+		return cmd.response(0);
+	}
+
+	odict *command_queue_stats(Command &cmd) {
+
+		struct json_tcp_stats st;
+		memset(&st, 0, sizeof(st));
+		json_tcp_stats(cmd._jt, &st);
+
+		odict *od = cmd.response(0);
+		odict_entry_add(od, "queued", ODICT_INT, (int64_t)st.queued);
+		odict_entry_add(od, "queued_bytes", ODICT_INT, (int64_t)st.queued_bytes);
+		odict_entry_add(od, "max_queued_bytes", ODICT_INT, (int64_t)st.max_queued_bytes);
+		odict_entry_add(od, "dropped", ODICT_INT, (int64_t)st.n_dropped);
+		odict_entry_add(od, "coalesced", ODICT_INT, (int64_t)st.n_coalesced);
+
+		return od;
+	}
+
+	// The runtime metrics, with the frames and bytes of this connection.
+	// With the parameter "reset", the latency window starts again
+	odict *command_stats(Command &cmd) {
+
+		bool reset = false;
+		if (cmd.more()) {
+			const char *what;
+			if (odict *r = cmd.string(what, "reset")) {
+				return r;
+			}
+			if (strcmp(what, "reset") != 0) {
+				return cmd.invalid("reset", "is unknown");
+			}
+			reset = true;
+		}
+
+		QueueStats qs;
+		collect_queue_stats(qs);
+
+		struct json_tcp_stats io;
+		memset(&io, 0, sizeof(io));
+		json_tcp_stats(cmd._jt, &io);
+
+		odict *depths = nullptr;
+		odict_alloc(&depths, DICT_BSIZE);
+		for (uint32_t p = 0; p < Priorities; ++p) {
+			char key[16];
+			re_snprintf(key, sizeof(key), "%u", p);
+			odict_entry_add(depths, key, ODICT_INT, (int64_t)qs.depths[p]);
+		}
+
+		auto counter = [](const std::atomic<uint64_t> &c) {
+			return (int64_t)c.load(std::memory_order_relaxed);
+		};
+
+		odict *od = cmd.response(0);
+		odict_entry_add(od, "sessions", ODICT_INT, (int64_t)qs.sessions);
+		odict_entry_add(od, "orphans", ODICT_INT, (int64_t)qs.orphans);
+		odict_entry_add(od, "pending_calls", ODICT_INT, (int64_t)PendingCalls.size());
+		odict_entry_add(od, "queue_depths", ODICT_ARRAY, depths);
+		odict_entry_add(od, "deferred", ODICT_INT, (int64_t)qs.deferred);
+		odict_entry_add(od, "commands", ODICT_INT, counter(Counters.commands));
+		odict_entry_add(od, "commands_per_sec", ODICT_DOUBLE, Loop.command_rate);
+		odict_entry_add(od, "events", ODICT_INT, counter(Counters.events));
+		odict_entry_add(od, "events_per_sec", ODICT_DOUBLE, Loop.event_rate);
+		odict_entry_add(od, "frames_in", ODICT_INT, (int64_t)io.n_rx);
+		odict_entry_add(od, "bytes_in", ODICT_INT, (int64_t)io.bytes_rx);
+		odict_entry_add(od, "frames_out", ODICT_INT, (int64_t)io.n_tx);
+		odict_entry_add(od, "bytes_out", ODICT_INT, (int64_t)io.bytes_tx);
+		odict_entry_add(od, "atoms_started", ODICT_INT, counter(Counters.atoms_started));
+		odict_entry_add(od, "atoms_failed", ODICT_INT, counter(Counters.atoms_failed));
+		odict_entry_add(od, "record_bytes", ODICT_INT, counter(Counters.record_bytes));
+		odict_entry_add(od, "assets", ODICT_INT, (int64_t)Assets.size());
+		odict_entry_add(od, "asset_hit_rate", ODICT_DOUBLE, asset_hit_rate());
+		odict_entry_add(od, "prefetched", ODICT_INT, (int64_t)Prefetch.issued);
+		odict_entry_add(od, "prefetch_over_budget", ODICT_INT, (int64_t)Prefetch.skipped);
+		odict_entry_add(od, "loop_lag_ms", ODICT_INT, (int64_t)Loop.lag);
+		odict_entry_add(od, "max_loop_lag_ms", ODICT_INT, (int64_t)Loop.max_lag);
+
+		odict *latency = nullptr;
+		odict_alloc(&latency, DICT_BSIZE);
+		odict *command_audio = latency_dict(Latency.command_audio);
+		odict *resume_audio = latency_dict(Latency.resume_audio);
+		odict *event_wire = latency_dict(Latency.event_wire);
+		odict_entry_add(latency, "window_ms", ODICT_INT, (int64_t)(tmr_jiffies() - Latency.command_audio.since));
+		odict_entry_add(latency, "command_to_audio", ODICT_OBJECT, command_audio);
+		odict_entry_add(latency, "resume_to_audio", ODICT_OBJECT, resume_audio);
+		odict_entry_add(latency, "event_to_wire", ODICT_OBJECT, event_wire);
+		odict_entry_add(od, "latency_us", ODICT_OBJECT, latency);
+		mem_deref(command_audio);
+		mem_deref(resume_audio);
+		mem_deref(event_wire);
+		mem_deref(latency);
+		mem_deref(depths);
+
+		if (reset) {
+			histogram_reset(&Latency.command_audio);
+			histogram_reset(&Latency.resume_audio);
+			histogram_reset(&Latency.event_wire);
+		}
+
+		return od;
+	}
+
+	// Set the log level of a subsystem or, without one, of all of them:
+	// [subsystem] level. Responds with the levels
+	odict *command_log_level(Command &cmd) {
+
+		const char *names[2];
+		size_t n = 0;
+		while (n < 2 && cmd.more()) {
+			if (odict *r = cmd.string(names[n], n == 0 ? "subsystem or level" : "level")) {
+				return r;
+			}
+			++n;
+		}
+
+		if (n) {
+			enum slog_level level;
+			if (slog_level_parse(&level, names[n - 1])) {
+				return cmd.response(EINVAL, "invalid log level");
+			}
+
+			if (n == 2) {
+				enum slog_sub sub;
+				if (slog_sub_parse(&sub, names[0])) {
+					return cmd.response(EINVAL, "invalid subsystem");
+				}
+				slog_level_set(sub, level);
+			}
+			else {
+				for (int i = 0; i < SLOG_SUBSYSTEMS; ++i) {
+					slog_level_set((slog_sub)i, level);
+				}
+			}
+		}
+
+		odict *levels = nullptr;
+		odict_alloc(&levels, DICT_BSIZE);
+		for (int i = 0; i < SLOG_SUBSYSTEMS; ++i) {
+			odict_entry_add(levels, slog_sub_name((slog_sub)i), ODICT_STRING,
+				slog_level_name((slog_level)SLOG_LEVEL(i)));
+		}
+
+		odict *od = cmd.response(0);
+		odict_entry_add(od, "levels", ODICT_OBJECT, levels);
+		odict_entry_add(od, "dropped", ODICT_INT, (int64_t)slog_dropped());
+		mem_deref(levels);
+
+		return od;
+	}
+
+	odict *command_event_ring(Command &cmd) {
+
+		// The reader mapped the fds of the first ring, a second one would
+		// leave it reading a ring that is no longer written
+		if (Connections[cmd._jt]._ring) {
+			return cmd.response(EBUSY, "event ring already set up");
+		}
+
+		int64_t capacity = EVR_CAPACITY;
+
+		if (cmd._has_params && cmd._params.peek() != j_end) {
+			if (odict *r = cmd.integer(capacity, "capacity")) {
+				return r;
+			}
+			if (capacity < 1 || capacity > EVR_MAX_CAPACITY || (capacity & (capacity - 1))) {
+				return cmd.invalid("capacity", "is not a power of 2 up to 65536");
+			}
+		}
+
+		struct event_ring *er = nullptr;
+		int err = event_ring_alloc(&er, (uint32_t)capacity);
+		if (err) {
+			warning("command %s: failed to allocate event ring (%m)\n", cmd._name, err);
+			return cmd.response(err, "failed to allocate event ring");
+		}
+
+		// The response carries the memfd and the eventfd
+		int fds[2];
+		event_ring_fds(er, fds);
+
+		err = json_tcp_send_fds(cmd._jt, cmd.response(0), fds, 2);
+		if (err) {
+			mem_deref(er);
+			return cmd.response(err, "event ring requires a unix domain socket");
+		}
+
+		Connections[cmd._jt]._ring.reset(er);
+
+		return nullptr;
+	}
+
+	odict *command_subscribe(Command &cmd) {
+
+		uint32_t mask;
+		if (odict *r = event_mask(cmd, mask)) {
+			return r;
+		}
+
+		Connections[cmd._jt]._events = mask;
+
+		return cmd.response(0);
+	}
+
+	odict *listen_address(Command &cmd, const char *addr) {
+
+		// Claim an existing user agent if no other world owns it
+		for (auto &[agent, owner] : UserAgents) {
+			if (str_cmp(account_aor(ua_account(agent)), addr) != 0) {
+				continue;
+			}
+
+			if (owner && owner != cmd._jt) {
+				warning("command %s: %s is owned by another connection\n",
+					cmd._name, addr);
+				return cmd.response(EBUSY, "address owned by another connection");
+			}
+
+			owner = cmd._jt;
+
+			return cmd.response(0);
+		}
+
+		struct ua *agent;
+
+		int err = ua_alloc(&agent, addr);
+		if (!err) {
+			UserAgents.insert(std::make_pair(agent, cmd._jt));
+		}
+
+		return cmd.response(err);
+	}
+
+	odict *command_listen(Command &cmd) {
+
+		const char* addr;
+		if (odict *r = cmd.string(addr, "address")) {
+			return r;
+		}
+
+		// Calls are taken once the assets of the preload manifest are warm
+		if (StartupPreload) {
+			StartupPreload->waiters.push_back(defer_command(cmd, 1, true,
+				[addr = std::string(addr)](Command &c) {
+					return listen_address(c, addr.c_str());
+				}));
+			return nullptr;
+		}
+
+		return listen_address(cmd, addr);
+	}
+
+	// Read the assets matching the paths or globs into the page cache in
+	// parallel, and respond when they are warm
+	odict *command_preload(Command &cmd) {
+
+		std::vector<std::string> patterns;
+
+		while (cmd.more()) {
+			const char *pattern;
+			if (odict *r = cmd.string(pattern, "path")) {
+				return r;
+			}
+			patterns.push_back(pattern);
+		}
+
+		Preload *p = preload(std::move(patterns), std::string());
+		if (!p) {
+			return cmd.response(ENOMEM, "failed to start preloading");
+		}
+
+		// Other commands don't wait for the preload
+		p->waiters.push_back(defer_command(cmd, 1, false, [p](Command &c) {
+			odict *od = c.response(0);
+			odict_entry_add(od, "count", ODICT_INT, (int64_t)(p->done - p->missing));
+			odict_entry_add(od, "missing", ODICT_INT, (int64_t)p->missing);
+			odict_entry_add(od, "bytes", ODICT_INT, (int64_t)p->bytes);
+			odict_entry_add(od, "ms", ODICT_INT, (int64_t)p->ms);
+			return od;
+		}));
+
+		return nullptr;
+	}
+
+	odict *command_answer(Command &cmd) {
+
+		const char* cid;
+		if (odict *r = cmd.string(cid, "call id")) {
+			return r;
+		}
+
+		auto cit = PendingCalls.find(cid);
+		if (cit == PendingCalls.end()) {
+			return cmd.response(EINVAL, "no incoming call pending for call id");
+		}
+
+		if (cit->second.owner != cmd._jt) {
+			return cmd.response(EPERM, "call offered to another connection");
+		}
+
+		call *call = cit->second.call;
+
+		int err = call_answer(call, 200, VIDMODE_OFF);
+
+		if (!err) {
+
+			// Create the session, the handlers find it by its handle
+			Session* session = Sessions.insert(call, cmd._jt);
+			call_set_handlers(call, villa_call_event_handler,
+				villa_dtmf_handler, (void*)session->_handle);
+		}
+
+		PendingCalls.erase(cit);
+
+		return cmd.response(err);
+	}
+
+	odict *command_hangup(Command &cmd) {
+
+		const char* cid;
+		if (odict *r = cmd.string(cid, "call id")) {
+			return r;
+		}
+
+		// don't overtake a command for the session that waits for its assets
+		Session *session = Sessions.find(cid);
+		if (session && session->_jt == cmd._jt && session->_blocked) {
+			return backlog(cmd, *session, cid);
+		}
+
+		int64_t scode = 200;
+		const char* reason = "Bye";
+
+		if (cmd._params.peek() != j_end) {
+			if (odict *r = cmd.integer(scode, "status code")) {
+				return r;
+			}
+
+			if (cmd._params.peek() != j_end) {
+				if (odict *r = cmd.string(reason, "reason")) {
+					return r;
+				}
+			}
+		}
+
+		if (session) {
+			if (session->_jt != cmd._jt) {
+				return cmd.response(EPERM, "session owned by another connection");
+			}
+
+			session->hangup(scode, reason);
+
+			Sessions.erase(session);
+		}
+		else {
+			// hanging up a call that is gone already succeeds
+			auto cit = PendingCalls.find(cid);
+			if (cit == PendingCalls.end()) {
+				return cmd.response(0);
+			}
+
+			if (cit->second.owner != cmd._jt) {
+				return cmd.response(EPERM, "call offered to another connection");
+			}
+
+			call_hangup(cit->second.call, scode, reason);
+			PendingCalls.erase(cit);
+		}
+
+		return cmd.response(0);
+	}
+
+	// List the sessions that lost their controller and can be resumed
+	odict *command_orphans(Command &cmd) {
+
+		odict *sessions = nullptr;
+		odict_alloc(&sessions, DICT_BSIZE);
+
+		int index = 0;
+		for (size_t i = 0; i < Sessions.slots(); ++i) {
+			Session *session = Sessions.at(i);
+			if (!session || session->_jt) {
+				continue;
+			}
+
+			odict *entry = nullptr;
+			odict_alloc(&entry, DICT_BSIZE);
+			odict_entry_add(entry, "id", ODICT_STRING, session->_id.c_str());
+			odict_entry_add(entry, "seq", ODICT_INT, (int64_t)session->_journal._seq);
+
+			char key[16];
+			re_snprintf(key, sizeof(key), "%d", index++);
+			odict_entry_add(sessions, key, ODICT_OBJECT, entry);
+			mem_deref(entry);
+		}
+
+		odict *od = cmd.response(0);
+		odict_entry_add(od, "sessions", ODICT_ARRAY, sessions);
+		mem_deref(sessions);
+
+		return od;
+	}
+
+	// Take over a session and replay the events after seq
+	odict *command_resume(Command &cmd) {
+
+		const char* cid;
+		if (odict *r = cmd.string(cid, "call id")) {
+			return r;
+		}
+
+		int64_t seq = 0;
+		if (cmd._params.peek() != j_end) {
+			if (odict *r = cmd.integer(seq, "seq")) {
+				return r;
+			}
+		}
+
+		Session *found = Sessions.find(cid);
+		if (!found) {
+			return cmd.response(EINVAL, "session not found");
+		}
+
+		Session &session = *found;
+
+		if (session._jt && session._jt != cmd._jt) {
+			return cmd.response(EPERM, "session owned by another connection");
+		}
+
+		session.adopt(cmd._jt);
+
+		// Events that fell out of the journal are lost
+		uint64_t first = session._journal.first();
+		int64_t lost = first > (uint64_t)seq + 1 ? first - seq - 1 : 0;
+
+		odict *od = cmd.response(0);
+		odict_entry_add(od, "seq", ODICT_INT, (int64_t)session._journal._seq);
+		odict_entry_add(od, "lost", ODICT_INT, lost);
+
+		int err = json_tcp_send(cmd._jt, od);
+
+		for (auto &e : session._journal._entries) {
+			if (err) {
+				break;
+			}
+			if (e.seq > (uint64_t)seq) {
+				err = json_tcp_send_encoded(cmd._jt, e.json.get(), JSON_TCP_CRITICAL, nullptr, 0);
+			}
+		}
+
+		return nullptr;
+	}
+
+	odict *command_subscribe_session(Command &cmd, Session &session) {
+
+		uint32_t mask;
+		if (odict *r = event_mask(cmd, mask)) {
+			return r;
+		}
+
+		session._events = mask;
+
+		return cmd.response(0);
+	}
+
+	static const char *reason_names[] = { "start", "interrupt", "dtmf", "end_of_file" };
+	static const char *trace_action_names[] = { "start", "fail", "stop", "done", "idle" };
+
+	odict *trace_entry(const TraceEntry &e) {
+
+		odict *od = nullptr;
+		odict_alloc(&od, DICT_BSIZE);
+
+		odict_entry_add(od, "time_us", ODICT_INT, (int64_t)e.time);
+		odict_entry_add(od, "action", ODICT_STRING, trace_action_names[e.action]);
+		odict_entry_add(od, "reason", ODICT_STRING, reason_names[e.reason]);
+		if (e.atom >= 0) {
+			odict_entry_add(od, "token", ODICT_STRING, e.token);
+			odict_entry_add(od, "priority", ODICT_INT, (int64_t)e.priority);
+			odict_entry_add(od, "atom", ODICT_INT, (int64_t)e.atom);
+			odict_entry_add(od, "position", ODICT_INT, (int64_t)e.position);
+			odict_entry_add(od, "started", ODICT_INT, (int64_t)e.started);
+		}
+
+		return od;
+	}
+
+	// Chrome trace event (chrome://tracing, Perfetto): started atoms last
+	// until the next decision, the other decisions are instants
+	odict *chrome_event(const TraceEntry &e, uint64_t end, SessionHandle handle) {
+
+		odict *od = nullptr;
+		odict_alloc(&od, DICT_BSIZE);
+
+		odict *args = nullptr;
+		odict_alloc(&args, DICT_BSIZE);
+		odict_entry_add(args, "reason", ODICT_STRING, reason_names[e.reason]);
+		if (e.atom >= 0) {
+			odict_entry_add(args, "atom", ODICT_INT, (int64_t)e.atom);
+			odict_entry_add(args, "position", ODICT_INT, (int64_t)e.position);
+		}
+
+		odict_entry_add(od, "name", ODICT_STRING, e.atom >= 0 && e.token[0] ? e.token : trace_action_names[e.action]);
+		odict_entry_add(od, "cat", ODICT_STRING, trace_action_names[e.action]);
+		odict_entry_add(od, "ts", ODICT_INT, (int64_t)e.time);
+		odict_entry_add(od, "pid", ODICT_INT, (int64_t)handle);
+		odict_entry_add(od, "tid", ODICT_INT, (int64_t)e.priority);
+		if (e.action == trace_start) {
+			odict_entry_add(od, "ph", ODICT_STRING, "X");
+			odict_entry_add(od, "dur", ODICT_INT, (int64_t)(end - e.time));
+		}
+		else {
+			odict_entry_add(od, "ph", ODICT_STRING, "i");
+			odict_entry_add(od, "s", ODICT_STRING, "t");
+		}
+		odict_entry_add(od, "args", ODICT_OBJECT, args);
+		mem_deref(args);
+
+		return od;
+	}
+
+	// The scheduling decisions of a session, as "entries" or, with the
+	// format "chrome", as "traceEvents" of a Chrome trace file
+	odict *command_trace_dump(Command &cmd, Session &session) {
+
+		bool chrome = false;
+		if (cmd.more()) {
+			const char *format;
+			if (odict *r = cmd.string(format, "format")) {
+				return r;
+			}
+			if (strcmp(format, "chrome") == 0) {
+				chrome = true;
+			}
+			else if (strcmp(format, "json") != 0) {
+				return cmd.invalid("format", "is unknown");
+			}
+		}
+
+		std::vector<TraceEntry> entries;
+		session._queue._trace.each([&](const TraceEntry &e) {
+			entries.push_back(e);
+		});
+
+		odict *array = nullptr;
+		odict_alloc(&array, DICT_BSIZE);
+
+		uint64_t now = tmr_jiffies_usec();
+		for (size_t i = 0; i < entries.size(); ++i) {
+			char key[16];
+			re_snprintf(key, sizeof(key), "%zu", i);
+
+			odict *e = chrome
+				? chrome_event(entries[i], i + 1 < entries.size() ? entries[i + 1].time : now, session._handle)
+				: trace_entry(entries[i]);
+			odict_entry_add(array, key, ODICT_OBJECT, e);
+			mem_deref(e);
+		}
+
+		odict *od = cmd.response(0);
+		odict_entry_add(od, "recorded", ODICT_INT, (int64_t)session._queue._trace._count);
+		if (chrome) {
+			odict_entry_add(od, "displayTimeUnit", ODICT_STRING, "ms");
+			odict_entry_add(od, "traceEvents", ODICT_ARRAY, array);
+		}
+		else {
+			odict_entry_add(od, "entries", ODICT_ARRAY, array);
+		}
+		mem_deref(array);
+
+		return od;
+	}
+
+	// Decode an atom object directly into the molecule. Prototype atoms
+	// have no session
+	odict *parse_atom(Command &cmd, Session *session, Molecule &m) {
+
+		JsonReader &r = cmd._params;
+
+		std::string_view type;
+		const char *filename = nullptr;
+		int64_t offset = 0;
+		int64_t max_silence = 1000;
+		int64_t max_length = 120000;
+		bool dtmf_stop = false;
+
+		r.enter_object();
+
+		std::string_view key;
+		while (r.key(key)) {
+			bool ok;
+
+			if (key == "type") {
+				ok = r.string(type);
+			}
+			else if (key == "filename") {
+				ok = r.string(filename);
+			}
+			else if (key == "offset") {
+				ok = r.number(offset);
+			}
+			else if (key == "max_silence") {
+				ok = r.number(max_silence);
+			}
+			else if (key == "max_length") {
+				ok = r.number(max_length);
+			}
+			else if (key == "dtmf_stop") {
+				ok = r.boolean(dtmf_stop);
+			}
+			else {
+				ok = r.skip();
+			}
+
+			if (!ok) {
+				return cmd.invalid("atom", "has invalid member");
+			}
+		}
+
+		if (r.error()) {
+			return cmd.invalid("atom", "is malformed");
+		}
+
+		if (type == "play") {
+			if (!filename) {
+				return cmd.invalid("atom play", "missing filename");
+			}
+
+			m.emplace_back<Play>(session, filename);
+
+			if (offset > 0) {
+				m.back()->set_offset(offset);
+			}
+		}
+		else if (type == "record") {
+			if (!filename) {
+				return cmd.invalid("atom record", "missing filename");
+			}
+
+			m.emplace_back<Record>(session, filename, max_silence, max_length, dtmf_stop);
+		}
+
+		return nullptr;
+	}
+
+	// Parse priority, mode, the optional molecule id and the atoms
+	odict *parse_molecule(Command &cmd, Session *session, MoleculePtr &m) {
+
+		int64_t priority;
+		if (odict *r = cmd.integer(priority, "priority")) {
+			return r;
+		}
+
+		if (priority < 0 || priority >= Priorities) {
+			return cmd.invalid("priority", "out of range");
+		}
+
+		int64_t mod;
+		if (odict *r = cmd.integer(mod, "mode")) {
+			return r;
+		}
+
+		// released unless it is enqueued
+		m.reset(VQueue::alloc());
+		m->_priority = priority;
+		m->_mode = (mode)mod;
+
+		bool first = true;
+		for (++cmd._count; cmd.more(); ++cmd._count, first = false) {
+
+			json_type t = cmd._params.peek();
+
+			if (t == j_string && first) {
+				// the optional molecule id
+				const char *id;
+				cmd._params.string(id);
+				m->_id = id;
+				continue;
+			}
 
-	return od;
-}
+			if (t != j_object) {
+				return cmd.invalid("atom", "has invalid type");
+			}
 
-extern "C" {
+			if (odict *r = parse_atom(cmd, session, *m)) {
+				return r;
+			}
+		}
 
-	void villa_tcp_disconnected()
-	{
-		// Lost connection to world, hangup all calls
-		for (auto &[id, session] : Sessions) {
-			session.hangup(500, "Connection to world lost");
+		if (cmd._params.error()) {
+			return cmd.invalid("atom", "is malformed");
 		}
 
-		Sessions.clear();
+		return nullptr;
 	}
 
-	void villa_call_event_handler(struct call *call, enum call_event ev,
-			    const char *str, void *arg)
-	{
-		Session *session = (Session*)arg;
+	using Completion = std::function<odict*(Command &cmd, MoleculePtr &m)>;
 
-		switch (ev) {
-			case CALL_EVENT_CLOSED:
-			{
-				std::string cid(call_id(call));
+	// Complete the command once the assets of m are opened. Until then,
+	// the later frames for the session wait, or those of the connection
+	// without a session, so commands keep their order and the event loop
+	// doesn't block on the filesystem
+	odict *await_assets(Command &cmd, MoleculePtr m, Completion complete, Session *session = nullptr) {
+
+		std::vector<Asset*> assets;
+		for (auto &a : m->_atoms) {
+			if (Play *p = std::get_if<Play>(&a._op); p && !p->asset()->length) {
+				assets.push_back(p->asset());
+			}
+		}
 
-				auto sit = Sessions.find(cid);
-				if (sit != Sessions.end()) {
+		if (assets.empty() || !IoPool) {
+			return complete(cmd, m);
+		}
 
-					DEBUG_INFO("%s CALL_CLOSED\n", session->_id.c_str());
+		auto molecule = std::make_shared<MoleculePtr>(std::move(m));
 
-					session->hangup(200, str);
-					Sessions.erase(sit);
-				}
-				else {
-					auto cit = PendingCalls.find(cid);
-					if (cit != PendingCalls.end()) {
-						warning("%s CALL_CLOSED before accepted: %s\n",
-							session->_id.c_str(), str);
-						PendingCalls.erase(cit);
-						return;
-					}
-					else {
-						DEBUG_INFO("%s CALL_CLOSED, but no session found\n",
-							session->_id.c_str());
-					}
-				}
-			}
-			break;
-		default:
-			break;
+		Resume resolved = defer_command(cmd, assets.size(), true, [molecule, complete](Command &c) {
+			return complete(c, *molecule);
+		}, session);
+
+		for (Asset *a : assets) {
+			asset_resolve(a, resolved);
 		}
 
-		DEBUG_PRINTF("received call event: %s\n", call_event_name(ev));
+		return nullptr;
 	}
 
-	void villa_dtmf_handler(struct call *call, char key, void *arg)
-	{
-		(void)call;
+	// The session of a completed command, if the connection still owns it
+	Session *owned_session(Command &cmd, SessionHandle handle) {
+
+		Session *session = Sessions.find(handle);
 
-		Session *session = (Session*)arg;
+		return session && session->_jt == cmd._jt ? session : nullptr;
+	}
 
-		DEBUG_PRINTF("%s received DTMF event: key = '%c'\n", session->_id.c_str(), key ? key : '.');
+	// nullptr or the error response if another connection owns the template
+	odict *template_owned(Command &cmd, const std::string &name) {
 
-		session->dtmf(key);
+		auto tit = Templates.find(name);
+		if (tit != Templates.end() && tit->second.owner && tit->second.owner != cmd._jt) {
+			warning("command %s: %s is owned by another connection\n", cmd._name, name.c_str());
+			return cmd.response(EPERM, "template owned by another connection");
+		}
+
+		return nullptr;
 	}
 
-	void villa_event_handler(struct ua *ua, enum ua_event ev,
-		struct call *call, const char *prm, void *arg)
-	{
-		struct json_tcp *jt = (json_tcp*)arg;
-		(void)ua;
-		bool send_event = false;
+	odict *command_define_molecule(Command &cmd) {
 
-		switch (ev) {
+		const char *name;
+		if (odict *r = cmd.string(name, "name")) {
+			return r;
+		}
 
-		case UA_EVENT_CALL_INCOMING:
-		{
-			std::string cid(call_id(call));
-			DEBUG_PRINTF("%s: CALL_INCOMING: peer=%s --> local=%s\n",
-				cid.c_str(), call_peeruri(call), call_localuri(call));
-			PendingCalls.insert(std::make_pair(cid, call));
-			send_event = true;
-			break;
+		if (odict *r = template_owned(cmd, name)) {
+			return r;
 		}
-		case UA_EVENT_END_OF_FILE:
-		{
-			std::string cid(call_id(call));
-			DEBUG_PRINTF("%s END_OF_FILE\n", cid.c_str());
 
-			size_t now = tmr_jiffies();
+		MoleculePtr m(nullptr, VQueue::release);
+		if (odict *r = parse_molecule(cmd, nullptr, m)) {
+			return r;
+		}
 
-			auto session = Sessions.find(cid);
-			if (session == Sessions.end()) {
-				warning("%s END_OF_FILE: no session found\n", cid.c_str());
-				return;
+		// The files of templates must exist
+		return await_assets(cmd, std::move(m), [name = std::string(name)](Command &c, MoleculePtr &m) {
+
+			for (size_t i = 0; i < m->size(); ++i) {
+				if (std::holds_alternative<Play>(m->_atoms[i]._op) && !m->_atoms[i]->length()) {
+					char message[128];
+					re_snprintf(message, sizeof(message), "atom %zu: file not found", i);
+					warning("command %s: %s\n", c._name, message);
+					return c.response(ENOENT, message);
+				}
 			}
 
-			if (session->second._queue._active) {
-				Molecule *stopped = session->second._queue._active;
-				stopped->_time_stopped = now;
+			// another connection may have defined it while the assets were opened
+			if (odict *r = template_owned(c, name)) {
+				return r;
+			}
 
-				session->second._queue.schedule(VQueue::sched_end_of_file);
+			auto tit = Templates.find(name);
+			if (tit != Templates.end()) {
+				tit->second = Template{ std::move(m), c._jt };
 			}
 			else {
-				warning("villa: no molecule active, but UA_EVENT_END_OF_FILE received");
+				Templates.insert(std::make_pair(name, Template{ std::move(m), c._jt }));
 			}
 
-			break;
+			return c.response(0);
+		});
+	}
+
+	// Instantiate a template, optionally with a molecule id
+	odict *command_enqueue_template(Command &cmd, Session &session) {
+
+		const char *name;
+		if (odict *r = cmd.string(name, "name")) {
+			return r;
 		}
-		case UA_EVENT_MODULE:
-		{
-			std::string cid(call_id(call));
-			DEBUG_PRINTF("%s MODULE %s\n", cid.c_str(), prm);
 
-			auto session = Sessions.find(cid);
-			if (session == Sessions.end()) {
-				DEBUG_PRINTF("%s MODULE: no session found\n", cid.c_str());
-				return;
+		auto tit = Templates.find(name);
+		if (tit == Templates.end()) {
+			return cmd.invalid("name", "is not defined", ENOENT);
+		}
+
+		MoleculePtr m(VQueue::alloc(), VQueue::release);
+		m->assign(*tit->second.molecule, &session);
+
+		if (cmd._params.peek() != j_end) {
+			const char *id;
+			if (odict *r = cmd.string(id, "id")) {
+				return r;
 			}
+			m->_id = id;
+		}
 
-			std::stringstream ss(prm);
-    		std::string elem;
-			std::vector<std::string> elems;
+		session._queue.enqueue(m.release());
 
-		    while(std::getline(ss, elem, ',')) {
-        		elems.push_back(elem);
-    		}
+		return cmd.response(0);
+	}
 
-			if (elems.size() >= 3) {
-				if (elems[0] == "fvad" && elems[1] == "vad_rx") {
-					bool vad = elems[2] == "on";
+	odict *command_enqueue(Command &cmd, Session &session) {
 
-					session->second._vad = vad;
+		MoleculePtr m(nullptr, VQueue::release);
+		if (odict *r = parse_molecule(cmd, &session, m)) {
+			return r;
+		}
 
-					Molecule *active = session->second._queue._active;
-					if (active && active->is_active()) {
-						active->current()->event_vad(&session->second, vad);
-					}
-				}
-			}
-			else {
-				warning("unknown event format '%s\n", prm);
+		return await_assets(cmd, std::move(m), [handle = session._handle](Command &c, MoleculePtr &m) {
+
+			Session *session = owned_session(c, handle);
+			if (!session) {
+				return c.response(EINVAL, "session not found");
 			}
-			break;
-		}
-		default:
-			warning("villa: unhandled event %s\n", uag_event_str(ev));
-			break;
+
+			session->_queue.enqueue(m.release());
+
+			return c.response(0);
+		}, &session);
+	}
+
+	// enqueue after a delay in ms
+	odict *command_enqueue_after(Command &cmd, Session &session) {
+
+		int64_t delay;
+		if (odict *r = cmd.integer(delay, "delay")) {
+			return r;
 		}
 
-		if (send_event) {
+		if (delay < 0) {
+			return cmd.invalid("delay", "out of range");
+		}
 
-			struct odict *od = NULL;
+		MoleculePtr m(nullptr, VQueue::release);
+		if (odict *r = parse_molecule(cmd, &session, m)) {
+			return r;
+		}
 
-			int err = odict_alloc(&od, DICT_BSIZE);
-			if (err)
-				return;
+		return await_assets(cmd, std::move(m), [handle = session._handle, delay](Command &c, MoleculePtr &m) {
 
-			err = odict_entry_add(od, "event", ODICT_BOOL, true);
-			err |= event_encode_dict(od, ua, ev, call, prm);
-			if (err) {
-				DEBUG_WARNING("villa: failed to encode event (%m)\n", err);
-				return;
+			Session *session = owned_session(c, handle);
+			if (!session) {
+				return c.response(EINVAL, "session not found");
 			}
 
-			json_tcp_send(jt, od);
-		}
+			session->_queue.defer(m.release(), delay);
+
+			return c.response(0);
+		}, &session);
 	}
 
-	size_t optional_offset(const odict* entry) {
+	// enqueue at a wall clock time in ms since the epoch
+	odict *command_enqueue_at(Command &cmd, Session &session) {
 
-		size_t offset = 0;
-		const odict_entry *eo = odict_lookup(entry, "offset");
-		if (eo) {
-			if (odict_entry_type(eo) != ODICT_INT) {
-				warning("command enqueue: optional offset has invalid type");
-				return 0;
-			}
-			offset = odict_entry_int(eo);
+		int64_t at;
+		if (odict *r = cmd.integer(at, "time")) {
+			return r;
 		}
 
-		return offset;
-	}
+		MoleculePtr m(nullptr, VQueue::release);
+		if (odict *r = parse_molecule(cmd, &session, m)) {
+			return r;
+		}
 
-	struct odict *villa_command_handler(const char* command,
-		struct odict *parms, const char* token, struct json_tcp *jt)
-	{
-		if (strcmp(command, "listen") == 0) {
+		return await_assets(cmd, std::move(m), [handle = session._handle, at](Command &c, MoleculePtr &m) {
 
-			struct le *le = parms->lst.head;
-			if (!le) {
-				warning("command %s: parameter missing\n", command);
-				return create_response(command, token, EINVAL, "parameter missing");
+			Session *session = owned_session(c, handle);
+			if (!session) {
+				return c.response(EINVAL, "session not found");
 			}
 
-			const odict_entry *e = (const odict_entry*)le->data;
-			if (odict_entry_type(e) != ODICT_STRING) {
-				warning("command %s: parameter has invalid type\n", command);
-				return create_response(command, token, EINVAL, "parameter has invalid type");
-			}
+			auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::system_clock::now().time_since_epoch()).count();
 
-			const char* addr = odict_entry_str(e);
+			session->_queue.defer(m.release(), at > now ? at - now : 0);
 
-			struct ua *agent;
+			return c.response(0);
+		}, &session);
+	}
 
-			int err = ua_alloc(&agent, addr);
-			if (!err) {
-				UserAgents.push_back(agent);
-			}
+	odict *command_discard_range(Command &cmd, Session &session) {
 
-			return create_response(command, token, err);
+		int64_t prio_from;
+		if (odict *r = cmd.integer(prio_from, "prio_from")) {
+			return r;
 		}
-		else if (strcmp(command, "answer") == 0) {
 
-			struct le *le = parms->lst.head;
-			if (!le) {
-				warning("command %s: parameter missing\n", command);
-				return create_response(command, token, EINVAL, "parameter missing");
-			}
+		if (prio_from < 0 || prio_from >= Priorities) {
+			return cmd.invalid("prio_from", "out of range");
+		}
 
-			const odict_entry *e = (const odict_entry*)le->data;
-			if (odict_entry_type(e) != ODICT_STRING) {
-				warning("command %s: parameter has invalid type\n", command);
-				return create_response(command, token, EINVAL, "parameter has invalid type");
-			}
+		int64_t prio_to;
+		if (odict *r = cmd.integer(prio_to, "prio_to")) {
+			return r;
+		}
 
-			std::string cid(odict_entry_str(e));
+		if (prio_to < 0 || prio_to > Priorities) {
+			return cmd.invalid("prio_to", "out of range");
+		}
 
-			auto cit = PendingCalls.find(cid);
-			if (cit == PendingCalls.end()) {
-				return create_response(command, token, EINVAL, "no incoming call pending for call id");
-			}
+		session._queue.discard_range(prio_from, prio_to);
+		session._queue.schedule(VQueue::sched_interrupt);
 
-			call *call = cit->second;
+		return cmd.response(0);
+	}
 
-			int err = call_answer(cit->second, 200, VIDMODE_OFF);
+	odict *command_discard(Command &cmd, Session &session) {
 
-			if (!err) {
+		const char *token_to_stop;
+		if (odict *r = cmd.string(token_to_stop, "token_to_stop")) {
+			return r;
+		}
 
-				// Create the session
-				const auto [it, _] = Sessions.insert(std::make_pair(cid, Session(call, jt)));
+		VQueue::discard_result result = VQueue::discard_nothing;
 
-				Session* session = &it->second;
-				call_set_handlers(call, villa_call_event_handler,
-		       		villa_dtmf_handler, session);
-			}
+		Molecule *m = session._queue.find(token_to_stop);
+		if (m) {
+			result = session._queue.discard(m);
+		}
 
-			PendingCalls.erase(cit);
+		if (result == VQueue::discard_active) {
+			session._queue.schedule(VQueue::sched_interrupt);
+		}
 
-			return create_response(command, token, err);
+		if (result == VQueue::discard_nothing) {
+			return cmd.response(ENOENT, "molecule not found");
 		}
-		else if (strcmp(command, "hangup") == 0) {
 
-			struct le *le = parms->lst.head;
-			if (!le) {
-				warning("command %s: parameter missing\n", command);
-				return create_response(command, token, EINVAL, "parameter missing");
-			}
+		return cmd.response(0);
+	}
 
-			const odict_entry *e = (const odict_entry*)le->data;
-			if (odict_entry_type(e) != ODICT_STRING) {
-				warning("command %s: parameter has invalid type\n", command);
-				return create_response(command, token, EINVAL, "parameter has invalid type");
-			}
+	// Discard molecules by token or token prefix and reschedule once
+	odict *discard_bulk(Command &cmd, Session &session, bool prefix) {
 
-			const char* cid = odict_entry_str(e);
+		size_t count = 0;
+		bool active = false;
 
-			int16_t scode = 200;
-			const char* reason = "Bye";
+		const char *token;
+		if (odict *r = cmd.string(token, prefix ? "prefix" : "token")) {
+			return r;
+		}
 
-			le = le->next;
-			if (le) {
-				const odict_entry *e = (const odict_entry*)le->data;
-				if (odict_entry_type(e) != ODICT_INT) {
-					warning("command %s: parameter 2 has invalid type\n", command);
-					return create_response(command, token, EINVAL, "parameter 2 has invalid type");
-				}
-				scode = odict_entry_int(e);
-
-				le = le->next;
-				if (le) {
-					e = (const odict_entry*)le->data;
-					if (odict_entry_type(e) != ODICT_STRING) {
-						warning("command %s parameter 3 invalid type\n", command);
-						return create_response(command, token, EINVAL, "parameter 3 has invalid type");
-					}
-					reason = odict_entry_str(e);
+		for (;;) {
+			count += prefix ? session._queue.discard_prefix(token, active)
+				: session._queue.discard_token(token, active);
+
+			if (prefix || cmd._params.peek() == j_end) {
+				break;
+			}
+
+			if (odict *r = cmd.string(token, "token")) {
+				if (active) {
+					session._queue.schedule(VQueue::sched_interrupt);
 				}
+				return r;
 			}
+		}
+
+		if (active) {
+			session._queue.schedule(VQueue::sched_interrupt);
+		}
+
+		odict *od = cmd.response(0);
+		odict_entry_add(od, "discarded", ODICT_INT, (int64_t)count);
+
+		return od;
+	}
+
+	odict *command_discard_tokens(Command &cmd, Session &session) {
+		return discard_bulk(cmd, session, false);
+	}
+
+	odict *command_discard_prefix(Command &cmd, Session &session) {
+		return discard_bulk(cmd, session, true);
+	}
 
-			auto sit = Sessions.find(cid);
-			if (sit != Sessions.end()) {
-				sit->second.hangup(scode, reason);
+	// Add or remove sessions of this connection to or from a group
+	odict *group_members(Command &cmd, bool join) {
 
-				Sessions.erase(sit);
+		const char *name;
+		if (odict *r = cmd.string(name, "group")) {
+			return r;
+		}
+
+		// validate the whole list before the group is changed
+		std::vector<SessionHandle> handles;
+
+		while (cmd._params.peek() != j_end) {
+			const char *cid;
+			if (odict *r = cmd.string(cid, "call id")) {
+				return r;
 			}
-			else {
-				auto cit = PendingCalls.find(cid);
-				if (cit != PendingCalls.end()) {
-					call_hangup(cit->second, scode, reason);
-				}
-				else {
-					create_response(command, token, EINVAL);
+
+			Session *session = Sessions.find(cid);
+			if (!session || session->_jt != cmd._jt) {
+				if (join) {
+					return cmd.invalid("call id", "is not a session of this connection");
 				}
+				continue;
 			}
 
-			return create_response("hangup", token, 0);
+			handles.push_back(session->_handle);
 		}
 
-		else {
+		auto &groups = Connections[cmd._jt]._groups;
 
-			struct le *le = parms->lst.head;
-			if (!le) {
-				warning("command %s: parameter missing\n", command);
-				return create_response(command, token, EINVAL, "parameter missing");
+		if (join) {
+			if (!handles.empty()) {
+				groups[name].insert(handles.begin(), handles.end());
 			}
+			return cmd.response(0);
+		}
+
+		auto git = groups.find(name);
+		if (git == groups.end()) {
+			return cmd.response(0);
+		}
+
+		for (SessionHandle handle : handles) {
+			git->second.erase(handle);
+		}
+
+		if (git->second.empty()) {
+			groups.erase(git);
+		}
+
+		return cmd.response(0);
+	}
+
+	odict *command_group_join(Command &cmd) {
+		return group_members(cmd, true);
+	}
+
+	odict *command_group_leave(Command &cmd) {
+		return group_members(cmd, false);
+	}
+
+	// The sessions of the group that are still owned by the connection.
+	// Members that are gone are forgotten
+	odict *group_sessions(Command &cmd, std::vector<Session*> &sessions) {
+
+		const char *name;
+		if (odict *r = cmd.string(name, "group")) {
+			return r;
+		}
 
-			const odict_entry *e = (const odict_entry*)le->data;
-			if (odict_entry_type(e) != ODICT_STRING) {
-				warning("command %s: parameter has invalid type\n", command);
-				return create_response(command, token, EINVAL, "parameter has invalid type");
+		auto &groups = Connections[cmd._jt]._groups;
+		auto git = groups.find(name);
+		if (git == groups.end()) {
+			return cmd.invalid("group", "not found", ENOENT);
+		}
+
+		auto &group = git->second;
+
+		for (auto hit = group.begin(); hit != group.end();) {
+			Session *session = Sessions.find(*hit);
+			if (!session || session->_jt != cmd._jt) {
+				hit = group.erase(hit);
+				continue;
 			}
 
-			const char* call_id = odict_entry_str(e);
-			auto sit = Sessions.find(call_id);
-			if (sit == Sessions.end()) {
-				warning("command %s: session %s not found\n", command, call_id);
-				return create_response(command, token, EINVAL, "session not found");
+			// it would overtake a command for the member
+			if (session->_blocked) {
+				warning("command %s: %s waits for its assets\n", cmd._name, session->_id.c_str());
+				return cmd.response(EAGAIN, "a member session waits for its assets");
 			}
 
-			Session& session = sit->second;
+			sessions.push_back(session);
+			++hit;
+		}
 
-			if (strcmp(command, "enqueue") == 0) {
+		return nullptr;
+	}
 
-				le = le->next;
-				if (!le) {
-					warning("command %s: parameter 2 (priority) missing\n", command);
-					return create_response(command, token, EINVAL, "parameter 2 (priority) missing");
-				}
+	// Parse the molecule once and enqueue a copy for every member
+	odict *command_group_enqueue(Command &cmd) {
 
-				e = (const odict_entry*)le->data;
-				if (odict_entry_type(e) != ODICT_INT) {
-					warning("command %s: parameter 2 (priority) invalid type\n", command);
-					return create_response(command, token, EINVAL, "parameter 2 (priority) invalid type");
-				}
+		std::vector<Session*> sessions;
+		if (odict *r = group_sessions(cmd, sessions)) {
+			return r;
+		}
 
-				Molecule m;
-				m._priority = odict_entry_int(e);
+		MoleculePtr proto(nullptr, VQueue::release);
+		if (odict *r = parse_molecule(cmd, nullptr, proto)) {
+			return r;
+		}
 
-				if (m._priority > max_priority) {
-					warning("command %s: parameter 2 (priority) priority too large\n", command);
-					return create_response(command, token, EINVAL, "parameter 2 (priority) too large");
-				}
+		std::vector<SessionHandle> handles;
+		for (Session *session : sessions) {
+			handles.push_back(session->_handle);
+		}
 
-				le = le->next;
-				if (!le) {
-					warning("command %s: parameter 3 (mode) missing\n", command);
-					return create_response(command, token, EINVAL, "parameter 3 (mode) missing");
-				}
+		return await_assets(cmd, std::move(proto), [handles](Command &c, MoleculePtr &proto) {
 
-				e = (const odict_entry*)le->data;
-				if (odict_entry_type(e) != ODICT_INT) {
-					warning("command %s: parameter 3 (mode) invalid type\n", command);
-					return create_response(command, token, EINVAL, "parameter 3 (mode) invalid type");
+			int64_t count = 0;
+
+			for (SessionHandle handle : handles) {
+				Session *session = owned_session(c, handle);
+				if (!session) {
+					continue;
 				}
 
-				m._mode = (mode)odict_entry_int(e);
+				MoleculePtr m(VQueue::alloc(), VQueue::release);
+				m->assign(*proto, session);
+				session->_queue.enqueue(m.release());
+				++count;
+			}
 
-				int count = 4;
-				for (le = le->next; le; le = le->next, ++count) {
+			odict *od = c.response(0);
+			odict_entry_add(od, "count", ODICT_INT, count);
 
-					e = (const odict_entry*)le->data;
-					if (odict_entry_type(e) != ODICT_OBJECT) {
+			return od;
+		});
+	}
 
-						if (count == 4 && odict_entry_type(e) == ODICT_STRING) {
-							// the optional molecule id
-							m._id = odict_entry_str(e);
-							continue;
-						}
+	odict *command_group_discard(Command &cmd) {
 
-						warning("command %s: parameter %d (atom) has invalid type\n", command, count);
-						return create_response(command, token, EINVAL, "parameter (atom) has invalid type");
-					}
+		std::vector<Session*> sessions;
+		if (odict *r = group_sessions(cmd, sessions)) {
+			return r;
+		}
+
+		const char *token;
+		if (odict *r = cmd.string(token, "token")) {
+			return r;
+		}
+
+		size_t count = 0;
 
-					struct odict *atom = odict_entry_object(e);
-					std::string type(odict_string(atom, "type"));
+		for (Session *session : sessions) {
+			bool active = false;
+			count += session->_queue.discard_token(token, active);
+			if (active) {
+				session->_queue.schedule(VQueue::sched_interrupt);
+			}
+		}
 
-					if (type == "play") {
-						const char* filename = odict_string(atom, "filename");
-						if (!filename) {
-							warning("command %s: parameter %d (atom play) missing filename\n", command, count);
-							return create_response(command, token, EINVAL, "parameter (atom play) missing filename");
-						}
+		odict *od = cmd.response(0);
+		odict_entry_add(od, "discarded", ODICT_INT, (int64_t)count);
 
-						m.push_back(std::make_shared<Play>(&session, filename));
+		return od;
+	}
 
-						size_t offset = optional_offset(atom);
-						if (offset) {
-							m.back()->set_offset(offset);
-						}
-					}
-					else if (type == "record") {
-						const char* filename = odict_string(atom, "filename");
-						if (!filename) {
-							warning("command %s: parameter %d (atom) missing filename", command, count);
-							return create_response(command, token, EINVAL, "parameter (atom record) missing filename");
-						}
+	struct CommandEntry {
+		// either a connection command...
+		odict *(*handler)(Command &cmd);
+		// ...or a command for the session named by the first parameter
+		odict *(*session_handler)(Command &cmd, Session &session);
+	};
+
+	// Precomputed dispatch table, looked up without allocating
+	const std::unordered_map<std::string_view, CommandEntry> Commands = {
+		{ "ping", { command_ping, nullptr } },
+		{ "queue_stats", { command_queue_stats, nullptr } },
+		{ "stats", { command_stats, nullptr } },
+		{ "log_level", { command_log_level, nullptr } },
+		{ "event_ring", { command_event_ring, nullptr } },
+		{ "subscribe", { command_subscribe, nullptr } },
+		{ "listen", { command_listen, nullptr } },
+		{ "preload", { command_preload, nullptr } },
+		{ "answer", { command_answer, nullptr } },
+		{ "hangup", { command_hangup, nullptr } },
+		{ "orphans", { command_orphans, nullptr } },
+		{ "resume", { command_resume, nullptr } },
+		{ "subscribe_session", { nullptr, command_subscribe_session } },
+		{ "define_molecule", { command_define_molecule, nullptr } },
+		{ "enqueue", { nullptr, command_enqueue } },
+		{ "enqueue_template", { nullptr, command_enqueue_template } },
+		{ "group_join", { command_group_join, nullptr } },
+		{ "group_leave", { command_group_leave, nullptr } },
+		{ "group_enqueue", { command_group_enqueue, nullptr } },
+		{ "group_discard", { command_group_discard, nullptr } },
+		{ "enqueue_after", { nullptr, command_enqueue_after } },
+		{ "enqueue_at", { nullptr, command_enqueue_at } },
+		{ "discard_range", { nullptr, command_discard_range } },
+		{ "discard", { nullptr, command_discard } },
+		{ "trace_dump", { nullptr, command_trace_dump } },
+		{ "discard_tokens", { nullptr, command_discard_tokens } },
+		{ "discard_prefix", { nullptr, command_discard_prefix } },
+	};
+
+	odict *dispatch(Command &cmd) {
+
+		auto cit = Commands.find(cmd._name);
+		if (cit == Commands.end()) {
+			return cmd.response(EINVAL, "unknown command");
+		}
 
-						uint64_t max_silence = 1000;
-						odict_get_number(atom, &max_silence, "max_silence");
+		if (cit->second.handler) {
+			return cit->second.handler(cmd);
+		}
 
-						uint64_t max_length = 120000;
-						odict_get_number(atom, &max_length, "max_length");
+		const char* call_id;
+		if (odict *r = cmd.string(call_id, "call id")) {
+			return r;
+		}
 
-						bool dtmf_stop = false;
-						odict_get_boolean(atom, &dtmf_stop, "dtmf_stop");
+		Session *found = Sessions.find(call_id);
+		if (!found) {
+			warning("command %s: session %s not found\n", cmd._name, call_id);
+			return cmd.response(EINVAL, "session not found");
+		}
 
-						m.push_back(std::make_shared<Record>(&session, filename, max_silence, max_length, dtmf_stop));
-					}
-				}
+		Session& session = *found;
 
-				session._queue.enqueue(m);
+		if (session._jt != cmd._jt) {
+			warning("command %s: session %s owned by another connection\n", cmd._name, call_id);
+			return cmd.response(EPERM, "session owned by another connection");
+		}
 
-				return create_response(command, token, 0);
-			}
-			else if (strcmp(command, "discard_range") == 0) {
+		if (session._blocked) {
+			return backlog(cmd, session, call_id);
+		}
 
-				le = le->next;
-				if (!le) {
-					warning("command %s: parameter prio_from missing\n", command);
-					return create_response(command, token, EINVAL, "parameter missing");
-				}
+		return cit->second.session_handler(cmd, session);
+	}
 
-				e = (const odict_entry*)le->data;
-				if (odict_entry_type(e) != ODICT_INT) {
-					warning("command %s: parameter prio_from has invalid type\n", command);
-					return create_response(command, token, EINVAL, "parameter prio_from has invalid type");
-				}
+	odict *command_frame(char *frame, size_t len, struct json_tcp *jt, uint64_t arrived, int *errp)
+	{
+		auto cit = Connections.find(jt);
+		if (cit != Connections.end()) {
+			if (cit->second._backlogged >= Connection::max_backlog) {
+				SLOG(SLOG_VILLA, SLOG_WARN, "%zu frames wait for assets. Closing connection\n",
+					cit->second._backlogged);
+				*errp = ENOBUFS;
+				return nullptr;
+			}
 
-				int prio_from = odict_entry_int(e);
-				if (prio_from > max_priority) {
-					warning("command %s: parameter prio_from too large\n", command);
-					return create_response(command, token, EINVAL, "parameter prio_from too large");
-				}
+			// Wait behind a connection command that waits for its assets
+			if (cit->second._blocked) {
+				cit->second._backlog.push_back({ arrived, std::string(frame, len) });
+				++cit->second._backlogged;
+				return nullptr;
+			}
+		}
 
-				le = le->next;
-				if (!le) {
-					warning("command %s: parameter prio_to missing\n", command);
-					return create_response(command, token, EINVAL, "parameter prio_from missing");
-				}
+		return run_frame(frame, len, jt, arrived, errp);
+	}
 
-				e = (const odict_entry*)le->data;
-				int prio_to = odict_entry_int(e);
-				if (prio_to > max_priority) {
-					warning("command %s: parameter prio_to too large\n", command);
-					return create_response(command, token, EINVAL, "parameter prio_to too large");
-				}
+	odict *run_frame(char *frame, size_t len, struct json_tcp *jt, uint64_t arrived, int *errp)
+	{
+		JsonReader r(frame, frame + len);
 
-				if (session._queue._active) {
-					session._queue._active->stop();
-					session._queue._active = nullptr;
-				}
+		const char *type = nullptr;
+		const char *token = nullptr;
+		char *params = nullptr;
 
-				for (int prio = prio_from; prio < prio_to; ++prio) {
-					session._queue._molecules[prio].clear();
-				}
+		if (!r.enter_object()) {
+			SLOG(SLOG_VILLA, SLOG_WARN, "failed to decode JSON. Closing connection\n");
+			*errp = EINVAL;
+			return nullptr;
+		}
 
-				session._queue.schedule(VQueue::sched_interrupt);
+		// params are decoded when type and token are known
+		std::string_view key;
+		while (r.key(key)) {
+			if (key == "type") {
+				r.string(type);
+			}
+			else if (key == "token" && r.peek() != j_null) {
+				r.string(token);
+			}
+			else if (key == "params") {
+				params = r.pos();
+				r.skip();
+			}
+			else {
+				r.skip();
+			}
 
-				return create_response(command, token, 0);
+			if (r.error()) {
+				break;
 			}
-			else if (strcmp(command, "discard") == 0) {
+		}
 
-				le = le->next;
-				if (!le) {
-					warning("command %s: parameter token_to_stop missing\n", command);
-					return create_response(command, token, EINVAL, "parameter token_to_stop missing");
-				}
+		if (r.error() || !r.at_end()) {
+			SLOG(SLOG_VILLA, SLOG_WARN, "failed to decode JSON. Closing connection\n");
+			*errp = EINVAL;
+			return nullptr;
+		}
 
-				e = (const odict_entry*)le->data;
-				if (odict_entry_type(e) != ODICT_STRING) {
-					warning("command %s: parameter token_to_stop has invalid type\n", command);
-					return create_response(command, token, EINVAL, "parameter token_to_stop has invalid type");
-				}
+		if (!type) {
+			SLOG(SLOG_VILLA, SLOG_WARN, "command handler: missing command\n");
+			*errp = EINVAL;
+			return nullptr;
+		}
 
-				VQueue::discard_result result = VQueue::discard_nothing;
+		Command cmd(type, token, params, frame + len, jt);
 
-				for (auto &ml : session._queue._molecules) {
-					for (auto &m : ml) {
-						if (m._id == odict_entry_str(e)) {
-							result = session._queue.discard(&m);
-							break;
-						}
-					}
-				}
+		CommandClock clock(arrived);
+		odict *response = dispatch(cmd);
 
-				if (result == VQueue::discard_active) {
-					session._queue.schedule(VQueue::sched_interrupt);
-				}
+		// counted when it runs
+		if (!cmd._backlogged) {
+			Metrics::count(Counters.commands);
+		}
 
-				if (result == VQueue::discard_nothing) {
-					return create_response(command, token, ENOENT, "molecule not found");
-				}
+		return response;
+	}
 
-				return create_response(command, token, 0);
-			}
+	struct odict *villa_command_frame(char *frame, size_t len, struct json_tcp *jt, int *errp)
+	{
+		return command_frame(frame, len, jt, json_tcp_rx_time(jt), errp);
+	}
+
+	void villa_metrics_init()
+	{
+		histogram_reset(&Latency.command_audio);
+		histogram_reset(&Latency.resume_audio);
+		histogram_reset(&Latency.event_wire);
+		json_tcp_set_latency(&Latency.event_wire);
+
+		tmr_init(&Loop.tmr);
+		Loop.window = tmr_jiffies();
+		Loop.expected = Loop.window + lag_interval;
+		tmr_start(&Loop.tmr, lag_interval, lag_tick, nullptr);
+	}
+
+	void villa_metrics_close()
+	{
+		tmr_cancel(&Loop.tmr);
+		json_tcp_set_latency(nullptr);
+		MetricsSock = (http_sock*)mem_deref(MetricsSock);
+	}
+
+	// Serve the metrics in OpenMetrics text format on GET /metrics
+	int villa_metrics_listen(const struct sa *laddr)
+	{
+		int err = http_listen(&MetricsSock, laddr, metrics_request, nullptr);
+		if (err) {
+			warning("villa: failed to listen for metrics on %J (%m)\n", laddr, err);
+			return err;
 		}
 
-		return create_response(command, token, EINVAL, "unknown command");
+		info("villa: metrics on http://%J/metrics\n", laddr);
+
+		return 0;
 	}
 
 	int villa_status(struct re_printf *pf, void *arg)
 	{
-		(void)pf;
 		(void)arg;
 
-		return 0;
+		QueueStats qs;
+		collect_queue_stats(qs);
+
+		struct json_tcp_stats io;
+		json_tcp_totals(&io);
+
+		int err = re_hprintf(pf, "villa: %zu sessions (%zu orphaned), %zu pending calls\n",
+			qs.sessions, qs.orphans, PendingCalls.size());
+
+		err |= re_hprintf(pf, "  queue depths:");
+		for (uint32_t p = 0; p < Priorities; ++p) {
+			err |= re_hprintf(pf, " %zu", qs.depths[p]);
+		}
+		err |= re_hprintf(pf, ", %zu deferred\n", qs.deferred);
+
+		err |= re_hprintf(pf, "  commands: %llu (%.1f/s), events: %llu (%.1f/s)\n",
+			(unsigned long long)Counters.commands.load(std::memory_order_relaxed), Loop.command_rate,
+			(unsigned long long)Counters.events.load(std::memory_order_relaxed), Loop.event_rate);
+		err |= re_hprintf(pf, "  control: %llu frames, %llu bytes in, %llu frames, %llu bytes out\n",
+			(unsigned long long)io.n_rx, (unsigned long long)io.bytes_rx,
+			(unsigned long long)io.n_tx, (unsigned long long)io.bytes_tx);
+		err |= re_hprintf(pf, "  atoms: %llu started, %llu failed, %llu bytes recorded\n",
+			(unsigned long long)Counters.atoms_started.load(std::memory_order_relaxed),
+			(unsigned long long)Counters.atoms_failed.load(std::memory_order_relaxed),
+			(unsigned long long)Counters.record_bytes.load(std::memory_order_relaxed));
+		err |= re_hprintf(pf, "  assets: %zu, %.1f%% hits, %llu prefetched, %llu over budget\n",
+			Assets.size(), asset_hit_rate(),
+			(unsigned long long)Prefetch.issued, (unsigned long long)Prefetch.skipped);
+		err |= re_hprintf(pf, "  event loop lag: %llu ms, max %llu ms\n",
+			(unsigned long long)Loop.lag, (unsigned long long)Loop.max_lag);
+		err |= re_hprintf(pf, "  latency of the last %llu s:\n",
+			(unsigned long long)(tmr_jiffies() - Latency.command_audio.since) / 1000);
+		err |= print_latency(pf, "command to audio", Latency.command_audio);
+		err |= print_latency(pf, "resume to audio", Latency.resume_audio);
+		err |= print_latency(pf, "event to wire", Latency.event_wire);
+
+		return err;
 	}
 }
\ No newline at end of file
@@ -6,13 +6,82 @@
 #include <string>
 #include <regex>
 #include <chrono>
+#include <optional>
+#include <variant>
+#include <deque>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <atomic>
+
+#include "event_ring.h"
+#include "timer_wheel.h"
+#include "json_tcp.h"
+#include "histogram.h"
+#include "slog.h"
 
 #ifndef _VILLA_H_
 #define _VILLA_H_
 
 enum { PTIME = 40 };
 
-const int max_priority = 5;
+// The bitmap of non-empty priorities limits the number of priorities
+enum { max_priorities = 64 };
+
+// Number of priorities of each VQueue, from 0 to Priorities - 1
+extern uint32_t Priorities;
+
+// Atoms prefetched ahead of the current one per session
+extern uint32_t PrefetchAtoms;
+
+// Counters of the hot paths. Relaxed atomics, because the I/O pool
+// updates some of them
+struct Metrics {
+
+	static void count(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+		counter.fetch_add(n, std::memory_order_relaxed);
+	}
+
+	std::atomic<uint64_t> commands{0};
+	std::atomic<uint64_t> events{0};
+	std::atomic<uint64_t> atoms_started{0};
+	std::atomic<uint64_t> atoms_failed{0};
+	std::atomic<uint64_t> record_bytes{0};
+	// lengths of assets that were known, or had to be looked up
+	std::atomic<uint64_t> asset_hits{0};
+	std::atomic<uint64_t> asset_misses{0};
+};
+
+extern Metrics Counters;
+
+// Latencies of the control paths in µs, recorded on the main thread
+struct Latencies {
+	// from reading a command until an atom it scheduled is started
+	histogram command_audio;
+	// from scheduling until a preempted molecule starts again
+	histogram resume_audio;
+	// from sending an event until it is handed to the socket
+	histogram event_wire;
+};
+
+extern Latencies Latency;
+
+// the arrival (tmr_jiffies_usec) of the command being executed, or 0
+extern uint64_t CommandArrived;
+
+// The clock and the audio devices of the queues. villa_bench replaces
+// them to run the queues without calls
+struct AudioSeam {
+	// in ms
+	uint64_t (*now)();
+	struct audio *(*call_audio)(const struct call *call);
+	// mod == nullptr stops the source
+	int (*set_source)(struct audio *au, const char *mod, const char *device, size_t offset);
+	int (*set_player)(struct audio *au, const char *mod, const char *device);
+};
+
+extern AudioSeam Audio;
 
 template<typename X>
 struct deleter {
@@ -24,6 +93,13 @@ struct deleter {
 // Wrapping raw pointers
 
 using ausrc_st_ptr = std::unique_ptr<struct ausrc_st, deleter<struct ausrc_st> >;
+using event_ring_ptr = std::unique_ptr<struct event_ring, deleter<struct event_ring> >;
+using odict_ptr = std::unique_ptr<struct odict, deleter<struct odict> >;
+using mbuf_ptr = std::unique_ptr<struct mbuf, deleter<struct mbuf> >;
+
+// Refers to a Session in the SessionTable. Fits into a pointer, e.g. the
+// argument of the call handlers
+using SessionHandle = uintptr_t;
 
 enum mode {
 	m_discard = 1,
@@ -37,12 +113,26 @@ enum mode {
 };
 
 
+// Event types a controller can subscribe to
+enum event_type {
+	ev_call_incoming = 1,
+	ev_call_closed = 2,
+	ev_dtmf_begin = 4,
+	ev_dtmf_end = 8,
+	ev_molecule_done = 16,
+	ev_vad = 32,
+	ev_ua = 64, // other user agent events, e.g. registration
+	ev_default = ev_call_incoming | ev_call_closed | ev_dtmf_begin | ev_dtmf_end | ev_molecule_done,
+	ev_all = 127
+};
+
 struct Session;
 struct Molecule;
 
 struct AudioOp {
 
 	AudioOp(Session *session) : _session(session), _stopped(false) {}
+	virtual ~AudioOp() {}
 
 	virtual int start() = 0;
 	virtual void stop() = 0;
@@ -64,20 +154,94 @@ struct AudioOp {
 	bool _stopped;
 };
 
-using AudioOpPtr = std::shared_ptr<AudioOp>;
+// An audio file. Assets are interned, so Play atoms don't copy their name
+struct Asset {
+	std::string name;
+	size_t length = 0; // in ms, 0 until the file could be opened
+	// the file is being opened on the I/O pool
+	bool resolving = false;
+	// called when resolving is done
+	std::vector<std::function<void()> > waiters;
+	// the page cache is being warmed on the I/O pool
+	bool prefetching = false;
+	// when the page cache was warmed, in jiffies
+	uint64_t prefetched = 0;
+	// the number of AssetRefs, unreferenced assets may be evicted
+	size_t refs = 0;
+	// when the asset was last looked up, for evicting the least recently used
+	uint64_t used = 0;
+};
+
+// A counted reference that keeps an asset from being evicted
+class AssetRef {
+
+public:
+
+	AssetRef(Asset *a = nullptr) : _a(a) { if (_a) { ++_a->refs; } }
+	AssetRef(const AssetRef &o) : AssetRef(o._a) {}
+	AssetRef(AssetRef &&o) noexcept : _a(o._a) { o._a = nullptr; }
+	~AssetRef() { if (_a) { --_a->refs; } }
+
+	AssetRef& operator=(AssetRef o) noexcept { std::swap(_a, o._a); return *this; }
+
+	Asset *operator->() const { return _a; }
+	operator Asset*() const { return _a; }
+
+protected:
+
+	Asset *_a;
+};
+
+enum { max_assets = 16384 };
+
+// The asset for filename, created on first use. When there are more than
+// max_assets, the least recently used assets without references are evicted
+Asset *asset(std::string_view filename);
+// The length of an asset. With an I/O pool, 0 is returned while the file
+// is opened in the background
+size_t asset_length(Asset *a);
+// Open the asset on the I/O pool if its length is not known and call done
+// when that is finished, or right away
+void asset_resolve(Asset *a, std::function<void()> done);
+// Warm the page cache for an asset that will play soon, within the
+// global prefetch budget
+void asset_prefetch(Asset *a);
+
+enum { max_preload_threads = 64 };
+
+// Assets read in parallel on a pool of one thread per core, shared by
+// all preloads
+struct Preload {
+	std::string manifest;
+	size_t total = 0;
+	size_t done = 0;
+	size_t missing = 0;
+	size_t bytes = 0;
+	uint64_t started = 0;
+	// the time it took, in ms
+	uint64_t ms = 0;
+	struct tmr tmr_progress;
+	// called when all assets are read
+	std::vector<std::function<void()> > waiters;
+};
+
+// Preload the assets matching patterns and the manifest file, if any.
+// The Preload is freed after its waiters were called
+Preload *preload(std::vector<std::string> patterns, std::string manifest);
 
 class Play : public AudioOp {
 
 public:
 
-	Play(Session *session, const std::string& filename) : AudioOp(session) { set_filename(filename); };
+	Play(Session *session, std::string_view filename) : AudioOp(session) { set_filename(filename); };
 	virtual ~Play() {}
 
 	virtual int start();
 	virtual void stop();
 
-	size_t set_filename(const std::string& filename);
-	const std::string& filename() const { return _filename; }
+	size_t set_filename(std::string_view filename);
+	const std::string& filename() const { return _asset->name; }
+	Asset *asset() const { return _asset; }
 
 	virtual void set_offset(size_t offset) { _offset = offset; }
 	virtual size_t offset() const { return _offset; }
@@ -89,15 +253,10 @@ public:
 protected:
 
 	struct audio *_audio = nullptr;
-	std::string _filename;
-	mutable size_t _length = 0; // length in ms
+	AssetRef _asset;
 	size_t _offset = 0; // offset in ms
 };
 
-class Record;
-
-
-
 class Record : public AudioOp {
 
 public:
@@ -119,9 +278,13 @@ public:
 			: AudioOp(session), _filename(filename), _max_silence(max_silence),
 			_max_length(max_length), _dtmf_stop(dtmf_stop),
 			_timer_max_silence_id(this, timer_max_silence), _timer_max_length_id(this, timer_max_length) {
-		tmr_init(&_tmr_max_length);
-		tmr_init(&_tmr_max_silence);
+		wtmr_init(&_tmr_max_length);
+		wtmr_init(&_tmr_max_silence);
 	}
+	// The timer ids refer to this, so copies only take the parameters
+	Record(const Record& other) : Record(other._session, other._filename,
+		other._max_silence, other._max_length, other._dtmf_stop) {}
+	Record& operator=(const Record& other);
 	virtual ~Record() { stop(); }
 
 	virtual int start();
@@ -142,8 +305,8 @@ protected:
 
 	struct audio *_audio = nullptr;
 	size_t _last_vad_tstamp;
-	struct tmr _tmr_max_length;
-	struct tmr _tmr_max_silence;
+	struct wtmr _tmr_max_length;
+	struct wtmr _tmr_max_silence;
 	std::string _filename;
 	int _max_silence;
 	int _max_length;
@@ -153,30 +316,124 @@ protected:
 	TimerId _timer_max_length_id;
 };
 
+// An atom, stored inline in its Molecule
+struct Atom {
+
+	template<typename T, typename... Args>
+	Atom(std::in_place_type_t<T> type, Args&&... args)
+		: _op(type, std::forward<Args>(args)...) {}
+
+	AudioOp *operator->() {
+		return std::visit([](auto &op) -> AudioOp* { return &op; }, _op);
+	}
+
+	const AudioOp *operator->() const {
+		return std::visit([](auto &op) -> const AudioOp* { return &op; }, _op);
+	}
+
+	std::variant<Play, Record> _op;
+};
 
 struct Molecule {
 
-	void push_back(const AudioOpPtr &a) { _atoms.push_back(a); }
+	Molecule() = default;
+	Molecule(const Molecule &other) = delete;
+
+	template<typename T, typename... Args>
+	void emplace_back(Args&&... args) {
+		_atoms.emplace_back(std::in_place_type<T>, std::forward<Args>(args)...);
+	}
 
-	AudioOpPtr &back() { return _atoms.back(); }
+	Atom &back() { return _atoms.back(); }
 	size_t size() const { return _atoms.size(); }
-	AudioOpPtr &current();
+	Atom &current();
 	bool is_active() const { return _current < size(); }
 
 	void stop() { if (is_active()) { current()->stop(); } }
 
 	size_t length(int start = 0, int end = -1) const;
 	void set_position(size_t position_ms);
+	// instantiate a template for a session
+	void assign(const Molecule &proto, Session *session);
 	// return a description of the Molecule
 	std::string desc() const;
 
-	std::vector<AudioOpPtr> _atoms;
+	std::vector<Atom> _atoms;
 	size_t _current = 0;
 	size_t _time_started = 0;
 	size_t _time_stopped = 0;
 	int _priority = 0;
-	mode _mode;
+	mode _mode = (mode)0;
 	std::string _id;
+	// in the priority list or the deferred list of a VQueue
+	struct le _le = LE_INIT;
+	// for deferred molecules
+	struct wtmr _tmr = { LE_INIT, 0, nullptr, nullptr };
+	struct VQueue *_queue = nullptr;
+};
+
+using MoleculePtr = std::unique_ptr<Molecule, void(*)(Molecule*)>;
+
+// Recycled Molecule nodes. Nodes never move, so pointers to them are
+// stable handles for as long as the Molecule is queued
+struct MoleculePool {
+
+	Molecule *alloc();
+	void release(Molecule *m);
+
+	std::deque<Molecule> _nodes;
+	std::vector<Molecule*> _free;
+};
+
+enum trace_action : uint8_t {
+	trace_start,    // an atom was started
+	trace_fail,     // an atom failed to start
+	trace_stop,     // the active molecule was interrupted
+	trace_done,     // the molecule ended or was discarded
+	trace_idle      // nothing left to play
+};
+
+// A scheduling decision, see Trace
+struct TraceEntry {
+	uint64_t time;      // tmr_jiffies_usec()
+	uint64_t started;   // when the molecule started, tmr_jiffies()
+	uint32_t position;  // in the molecule or atom, in ms
+	int32_t atom;       // the current atom, -1 without a molecule
+	uint8_t reason;     // VQueue::reason
+	uint8_t action;     // trace_action
+	uint8_t priority;
+	char token[21];     // the molecule id, truncated
+};
+
+// entries per session, 0 disables tracing
+extern uint32_t TraceSize;
+
+// The last scheduling decisions of a queue in a fixed-size ring. Only the
+// main loop writes; recording is a few stores without formatting, and the
+// ring is allocated on the first decision
+struct Trace {
+
+	void record(uint8_t reason, trace_action action, const Molecule *m, uint32_t position) {
+		if (TraceSize) {
+			add(reason, action, m, position);
+		}
+	}
+
+	// the entries from the oldest to the newest
+	template<typename F>
+	void each(F f) const {
+		uint64_t n = std::min<uint64_t>(_count, _size);
+		for (uint64_t i = _count - n; i < _count; ++i) {
+			f(_entries[i % _size]);
+		}
+	}
+
+	void add(uint8_t reason, trace_action action, const Molecule *m, uint32_t position);
+
+	std::unique_ptr<TraceEntry[]> _entries;
+	uint32_t _size = 0;
+	// entries recorded, including the overwritten ones
+	uint64_t _count = 0;
 };
 
 struct VQueue {
@@ -194,48 +451,136 @@ struct VQueue {
 		discard_active
 	};
 
-	VQueue(Session *session = nullptr) : _session(session) {
-		_molecules.resize(max_priority + 1);
-	}
+	VQueue(Session *session = nullptr);
+	VQueue(const VQueue &other) = delete;
+	~VQueue() { clear(); }
+
+	// release all molecules, without molecule_done
+	void clear();
+
+	// A pooled Molecule to fill in and pass to enqueue, or to release
+	static Molecule *alloc();
+	static void release(Molecule *m);
 
 	discard_result discard(Molecule* m);
-	std::vector<Molecule>::iterator next();
-	std::vector<Molecule>::iterator end() { return _molecules[0].end(); }
+	// discard the molecules with priorities from <= p < to
+	void discard_range(uint32_t from, uint32_t to);
+	// discard all molecules with the token or the token prefix. Returns
+	// the number of molecules discarded, active is set if one was active
+	size_t discard_token(std::string_view token, bool &active);
+	size_t discard_prefix(std::string_view prefix, bool &active);
+	Molecule *find(std::string_view id);
+	// the first molecule of the highest non-empty priority
+	Molecule *next();
 
 	int schedule(reason);
 
-	int enqueue(const Molecule &m);
+	// takes ownership of m
+	int enqueue(Molecule *m);
+	// enqueue m after delay ms
+	void defer(Molecule *m, uint64_t delay);
+	// prefetch the atoms that play after the current one
+	void prefetch() const;
+
+protected:
+
+	static void deferred_timer(void *arg);
+	int insert(Molecule *m);
+
+	// unlink, unindex and release a molecule
+	void remove(Molecule *m);
+	size_t discard(std::vector<Molecule*> &ms, bool &active);
 
-	std::vector<std::vector<Molecule> > _molecules;
+public:
+
+	// one list of Molecules per priority
+	std::vector<struct list> _lists;
+	// bit p is set if _lists[p] is not empty
+	uint64_t _nonempty = 0;
+	// molecules waiting for their timer
+	struct list _deferred = LIST_INIT;
+	// queued and deferred molecules by id. The keys refer to Molecule::_id
+	std::unordered_multimap<std::string_view, Molecule*> _tokens;
 	Molecule *_active = nullptr;
-	int _current_id;
 	Session *_session;
+	Trace _trace;
 };
 
-struct Session {
+// Per controller connection state
+// A frame that waits behind a command, with its arrival
+struct Backlogged {
+	uint64_t arrived;
+	std::string frame;
+};
 
-	Session(struct call* call, struct json_tcp *_jt);
-	Session(const Session& other) = delete;
-	Session(Session&& other) {
-		_id = std::move(other._id);
-		_dtmf = std::move(other._dtmf);
-		_dtmf_start = std::move(other._dtmf_start);
+struct Connection {
+	// frames waiting on the connection and its sessions, above this the
+	// connection is closed
+	enum { max_backlog = 1024 };
+
+	// json_tcp pointers may be reused, ids are not
+	static inline uint64_t _next_id = 0;
+	uint64_t _id = ++_next_id;
+	// optional shared memory ring for high-rate events
+	event_ring_ptr _ring;
+	// mask of event_type
+	uint32_t _events = ev_default;
+	// the session groups, see group_enqueue
+	std::unordered_map<std::string, std::unordered_set<SessionHandle> > _groups;
+	// a connection command waits for its assets, the frames behind it
+	// are kept
+	bool _blocked = false;
+	std::deque<Backlogged> _backlog;
+	// the size of _backlog and of the backlogs of the sessions
+	size_t _backlogged = 0;
+};
+
+// Bounded ring of the encoded events sent for a session, replayed on resume
+struct Journal {
 
-		_call = other._call;
-		other._call = nullptr;
+	struct Entry {
+		uint64_t seq;
+		mbuf_ptr json;
+	};
 
-		_jt = other._jt;
-		other._jt = nullptr;
+	// stamp od with the next sequence number and return it
+	uint64_t stamp(struct odict *od);
+	// keep a reference to the encoded event seq
+	void append(uint64_t seq, struct mbuf *json);
+	// the oldest sequence number that can be replayed
+	uint64_t first() const { return _entries.empty() ? _seq + 1 : _entries.front().seq; }
 
-		_queue = std::move(other._queue);
-		_queue._session = this;
-	}
+	std::deque<Entry> _entries;
+	uint64_t _seq = 0;
+};
+
+struct Session {
+
+	Session(struct call* call, struct json_tcp *_jt);
+	// a session without a call, for villa_bench
+	Session(std::string_view id);
+	Session(const Session& other) = delete;
 
 	virtual ~Session();
 
 	virtual void dtmf(char key);
 	virtual void hangup(int16_t scode = 200, const char* reason = "BYE");
-	virtual void molecule_done(const Molecule &m) const;
+	virtual void molecule_done(const Molecule &m);
+	// write a record into the owner's event ring, if it has one
+	void ring_event(event_ring_type type, int32_t value, int32_t value2 = 0) const;
+	// check the subscriptions before building an event
+	bool wants(event_type type) const;
+	// journal the event and send it to the owner, if there is one
+	void send_event(struct odict *od, json_tcp_class cls = JSON_TCP_CRITICAL,
+		const char *key = nullptr);
+	// journal and send the encoded event seq, sent at t0 (tmr_jiffies_usec)
+	void deliver(uint64_t seq, struct mbuf *json, json_tcp_class cls,
+		const char *key, uint64_t t0);
+	// keep playing without a controller for the grace period
+	void orphan(uint32_t grace);
+	void adopt(struct json_tcp *jt);
+	// drop the frames waiting for this session
+	void drop_backlog();
 
 	std::string _id;
 	std::string _dtmf;
@@ -244,6 +589,57 @@ struct Session {
 	struct json_tcp *_jt;
 	VQueue _queue;
 	bool _vad;
+	// mask of event_type, overrides the connection's subscriptions if set
+	std::optional<uint32_t> _events;
+	Journal _journal;
+	struct tmr _tmr_grace;
+	SessionHandle _handle = 0;
+	// a command for this session waits for its assets, the later
+	// commands for it are kept
+	bool _blocked = false;
+	std::deque<Backlogged> _backlog;
+};
+
+// Sessions in slots that never move. A handle is the slot index and the
+// generation of the slot, so a stale handle doesn't find a new session.
+// Generations start at 1, so 0 is never a valid handle
+class SessionTable {
+
+public:
+
+	Session *insert(struct call *call, struct json_tcp *jt);
+	void erase(Session *session);
+
+	Session *find(SessionHandle handle);
+	Session *find(std::string_view call_id);
+	Session *find(struct call *call);
+
+	// iterate with at(i) for i < slots(), at() returns null for free slots.
+	// Erasing while iterating is safe
+	size_t slots() const { return _slots.size(); }
+	Session *at(size_t i) { return _slots[i].session ? &*_slots[i].session : nullptr; }
+
+protected:
+
+	enum { index_bits = 24 };
+	static constexpr SessionHandle generation_max = SessionHandle(-1) >> index_bits;
+
+	struct Slot {
+		std::optional<Session> session;
+		SessionHandle generation = 1;
+		// Session::_call is reset by hangup
+		struct call *call = nullptr;
+	};
+
+	SessionHandle handle(uint32_t index) const {
+		return _slots[index].generation << index_bits | index;
+	}
+
+	std::deque<Slot> _slots;
+	std::vector<uint32_t> _free;
+	// the keys refer to Session::_id
+	std::unordered_map<std::string_view, uint32_t> _by_id;
+	std::unordered_map<struct call*, uint32_t> _by_call;
 };
 
 #endif // #define _VILLA_H_
\ No newline at end of file
@@ -3,31 +3,70 @@
  *
  * Copyright (C) 2023 Lars Immisch
  */
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 #include <re.h>
 #include <baresip.h>
 
-#define DEBUG_MODULE "villa"
-#define DEBUG_LEVEL 7
-
-#include <re_dbg.h>
-
 #include "json_tcp.h"
+#include "timer_wheel.h"
+#include "slog.h"
 
-extern void villa_tcp_disconnected(void);
+extern void villa_tcp_disconnected(struct json_tcp *jt);
 
 extern void villa_event_handler(struct ua *ua, enum ua_event ev,
 	struct call *call, const char *prm, void *arg);
 
-extern struct odict *villa_command_handler(const char* command,
-	const struct odict *parms, const char* token, struct json_tcp *jt);
+extern struct odict *villa_command_frame(char *frame, size_t len,
+	struct json_tcp *jt, int *errp);
 
 extern int villa_status(struct re_printf *pf, void *arg);
 
+extern void villa_session_config(uint32_t grace_period,
+	uint32_t journal_size, uint32_t trace_size);
+
+extern void villa_queue_config(uint32_t priorities);
+
+extern int villa_io_config(uint32_t threads);
+
+extern void villa_prefetch_config(uint32_t atoms, uint32_t rate);
+
+extern void villa_preload_config(const char *manifest);
+
+extern void villa_preload_close(void);
+
+extern void villa_metrics_init(void);
+
+extern void villa_metrics_close(void);
+
+extern int villa_metrics_listen(const struct sa *laddr);
+
+extern void villa_io_close(void);
+
 enum { CTRL_PORT = 1235 };
 
 struct ctrl_st {
 	struct tcp_sock *ts;
-	struct tcp_conn *tc;
+#ifndef WIN32
+	re_sock_t ufd;         /* unix domain socket for local controllers */
+	struct re_fhs *ufhs;
+	bool seqpacket;
+	char upath[256];
+#endif
+	struct list connl;     /* struct ctrl_conn, one per controller */
+	uint32_t highwater;    /* outbound queue limits in bytes */
+	uint32_t hardcap;
+};
+
+/* A controller connection. Calls and AORs are owned by the connection
+   that claimed them, see villa.cpp */
+struct ctrl_conn {
+	struct le le;
+	struct ctrl_st *st;
+	struct tcp_conn *tc;   /* NULL for unix domain sockets */
 	struct json_tcp *jt;
 };
 
@@ -91,7 +130,7 @@ static int encode_response(int cmd_error, struct mbuf *resp, const char *token)
 
 	err = json_encode_odict(&pf, od);
 	if (err)
-		DEBUG_WARNING("villa: failed to encode response JSON (%m)\n",
+		SLOG(SLOG_VILLA, SLOG_WARN, "failed to encode response JSON (%m)\n",
 			err);
 
  out:
@@ -102,24 +141,17 @@ static int encode_response(int cmd_error, struct mbuf *resp, const char *token)
 }
 
 
-static bool command_handler(const struct odict *od, int *errp, void *arg)
+static bool command_handler(char *frame, size_t len, int *errp, void *arg)
 {
-	struct ctrl_st *st = arg;
+	struct ctrl_conn *conn = arg;
 
-	const char *cmd = odict_string(od, "type");
-	struct odict *prm = odict_get_array(od, "params");
-	const char *tok = odict_string(od, "token");
-	if (!cmd) {
-		DEBUG_PRINTF("villa: command handler: missing command\n");
-		*errp = EINVAL;
-		return true;
-	}
+	struct odict *resp = villa_command_frame(frame, len, conn->jt, errp);
+	if (!resp)
+		return true;  /* sent by the command, or *errp is set */
 
-	struct odict *resp = villa_command_handler(cmd, prm, tok, st->jt);
-
-	int err = json_tcp_send(st->jt, resp);
+	int err = json_tcp_send(conn->jt, resp);
 	if (err) {
-		DEBUG_WARNING("villa: failed to send the response (%m)\n", err);
+		SLOG(SLOG_VILLA, SLOG_WARN, "failed to send the response (%m)\n", err);
 		*errp = err;
 	}
 
@@ -127,102 +159,203 @@ static bool command_handler(const struct odict *od, int *errp, void *arg)
 }
 
 
-static void tcp_close_handler(int err, void *arg)
+/* libre's send queue of the TCP connection is empty */
+static void conn_send_handler(void *arg)
 {
-	struct ctrl_st *st = arg;
+	struct ctrl_conn *conn = arg;
+
+	json_tcp_send_ready(conn->jt);
+}
 
-	(void)err;
 
-	villa_tcp_disconnected();
+static void conn_destructor(void *arg)
+{
+	struct ctrl_conn *conn = arg;
 
-	st->tc = mem_deref(st->tc);
+	list_unlink(&conn->le);
+	mem_deref(conn->jt);
+	mem_deref(conn->tc);
 }
 
 
-static void tcp_conn_handler(const struct sa *peer, void *arg)
+static void conn_close_handler(int err, void *arg)
 {
-	struct ctrl_st *st = arg;
+	struct ctrl_conn *conn = arg;
 
-	(void)peer;
+	SLOG(SLOG_VILLA, SLOG_INFO, "controller connection closed (%m)\n", err);
 
-	/* only one connection allowed */
-	st->tc = mem_deref(st->tc);
-	st->jt = mem_deref(st->jt);
+	/* only the sessions owned by this connection are affected */
+	villa_tcp_disconnected(conn->jt);
 
-	(void)tcp_accept(&st->tc, st->ts, NULL, NULL, tcp_close_handler, st);
-	(void)json_tcp_insert(&st->jt, st->tc, 0, command_handler, st);
+	mem_deref(conn);
 }
 
 
-/*
- * Relay UA events
- */
-static void ua_event_handler(struct ua *ua, enum ua_event ev,
-			     struct call *call, const char *prm, void *arg)
+static void tcp_conn_handler(const struct sa *peer, void *arg)
 {
 	struct ctrl_st *st = arg;
+	struct ctrl_conn *conn;
+	int err;
 
-	if (!st->jt) {
+	conn = mem_zalloc(sizeof(*conn), conn_destructor);
+	if (!conn) {
+		tcp_reject(st->ts);
 		return;
 	}
 
-	villa_event_handler(ua, ev, call, prm, st->jt);
+	conn->st = st;
+
+	err = tcp_accept(&conn->tc, st->ts, NULL, NULL, conn_close_handler,
+		conn);
+	if (err)
+		goto out;
+
+	err = json_tcp_insert(&conn->jt, conn->tc, 0, command_handler,
+		conn_send_handler, conn_close_handler, conn);
+	if (err)
+		goto out;
+
+	json_tcp_set_limits(conn->jt, st->highwater, st->hardcap);
+
+	list_append(&st->connl, &conn->le, conn);
+
+	SLOG(SLOG_VILLA, SLOG_INFO, "controller connected from %J (%u connections)\n",
+		peer, list_count(&st->connl));
+
+ out:
+	if (err) {
+		SLOG(SLOG_VILLA, SLOG_WARN, "failed to accept controller %J (%m)\n",
+			peer, err);
+		mem_deref(conn);
+	}
 }
 
 
-static void message_handler(struct ua *ua, const struct pl *peer,
-			    const struct pl *ctype,
-			    struct mbuf *body, void *arg)
+#ifndef WIN32
+static void unix_conn_handler(int flags, void *arg)
 {
 	struct ctrl_st *st = arg;
-	struct mbuf *buf = mbuf_alloc(1024);
-	struct re_printf pf = {print_handler, buf};
-	struct odict *od = NULL;
+	struct ctrl_conn *conn;
 	int err;
 
-	buf->pos = 0;
+	(void)flags;
 
-	err = odict_alloc(&od, 8);
-	if (err)
+	re_sock_t fd = accept(st->ufd, NULL, NULL);
+	if (fd == RE_BAD_SOCK) {
+		SLOG(SLOG_VILLA, SLOG_WARN, "failed to accept on %s (%m)\n",
+			st->upath, errno);
 		return;
+	}
 
-	err  = odict_entry_add(od, "message", ODICT_BOOL, true);
-	err |= message_encode_dict(od, ua_account(ua), peer, ctype, body);
+	conn = mem_zalloc(sizeof(*conn), conn_destructor);
+	if (!conn) {
+		(void)close(fd);
+		return;
+	}
+
+	conn->st = st;
+
+	err = json_tcp_insert_fd(&conn->jt, fd, st->seqpacket,
+		command_handler, conn_close_handler, conn);
 	if (err) {
-		DEBUG_WARNING("villa: failed to encode message (%m)\n", err);
+		SLOG(SLOG_VILLA, SLOG_WARN, "failed to accept controller on %s (%m)\n",
+			st->upath, err);
+		(void)close(fd);
+		mem_deref(conn);
+		return;
+	}
+
+	json_tcp_set_limits(conn->jt, st->highwater, st->hardcap);
+
+	list_append(&st->connl, &conn->le, conn);
+
+	SLOG(SLOG_VILLA, SLOG_INFO, "controller connected on %s (%u connections)\n",
+		st->upath, list_count(&st->connl));
+}
+
+
+static int unix_listen(struct ctrl_st *st, const char *path, bool seqpacket)
+{
+	struct sockaddr_un un;
+	int err = 0;
+
+	if (str_len(path) >= sizeof(un.sun_path))
+		return ENAMETOOLONG;
+
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	str_ncpy(un.sun_path, path, sizeof(un.sun_path));
+
+	st->ufd = socket(AF_UNIX, seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, 0);
+	if (st->ufd == RE_BAD_SOCK)
+		return errno;
+
+	/* remove a stale socket from a previous run */
+	(void)unlink(path);
+
+	if (bind(st->ufd, (struct sockaddr *)&un, sizeof(un)) < 0) {
+		err = errno;
 		goto out;
 	}
 
-	err = json_encode_odict(&pf, od);
-	if (err) {
-		DEBUG_WARNING("villa: failed to encode event JSON (%m)\n", err);
+	str_ncpy(st->upath, path, sizeof(st->upath));
+	st->seqpacket = seqpacket;
+
+	if (listen(st->ufd, SOMAXCONN) < 0) {
+		err = errno;
 		goto out;
 	}
 
-	if (!st->tc)
+	err = net_sockopt_blocking_set(st->ufd, false);
+	if (err)
 		goto out;
 
-	err = tcp_send(st->tc, buf);
+	err = fd_listen(&st->ufhs, st->ufd, FD_READ, unix_conn_handler, st);
+
+ out:
 	if (err) {
-		DEBUG_WARNING("villa: failed to send the SIP message (%m)\n",
-			err);
+		(void)close(st->ufd);
+		st->ufd = RE_BAD_SOCK;
 	}
 
-out:
-	mem_deref(buf);
-	mem_deref(od);
+	return err;
 }
+#endif
+
+
+/*
+ * Relay UA events
+ */
+static void ua_event_handler(struct ua *ua, enum ua_event ev,
+			     struct call *call, const char *prm, void *arg)
+{
+	(void)arg;
+
+	/* villa.cpp routes the event to the connection owning ua or call */
+	villa_event_handler(ua, ev, call, prm, NULL);
+}
+
 
 static void ctrl_destructor(void *arg)
 {
 	struct ctrl_st *st = arg;
 
-	mem_deref(st->tc);
+	list_flush(&st->connl);
 	mem_deref(st->ts);
-	mem_deref(st->jt);
+
+#ifndef WIN32
+	if (st->ufhs)
+		st->ufhs = fd_close(st->ufhs);
+
+	if (st->ufd != RE_BAD_SOCK) {
+		(void)close(st->ufd);
+		(void)unlink(st->upath);
+	}
+#endif
 }
 
-static int ctrl_alloc(struct ctrl_st **stp, const struct sa *laddr)
+static int ctrl_alloc(struct ctrl_st **stp, const struct sa *laddr,
+	const char *upath, bool seqpacket)
 {
 	struct ctrl_st *st;
 	int err;
@@ -234,14 +367,39 @@ static int ctrl_alloc(struct ctrl_st **stp, const struct sa *laddr)
 	if (!st)
 		return ENOMEM;
 
+#ifndef WIN32
+	st->ufd = RE_BAD_SOCK;
+#endif
+
+	/* 0 keeps the json_tcp defaults */
+	(void)conf_get_u32(conf_cur(), "villa_tx_highwater", &st->highwater);
+	(void)conf_get_u32(conf_cur(), "villa_tx_hardcap", &st->hardcap);
+
 	err = tcp_listen(&st->ts, laddr, tcp_conn_handler, st);
 	if (err) {
-		DEBUG_WARNING("villa: failed to listen on TCP %J (%m)\n",
+		SLOG(SLOG_VILLA, SLOG_WARN, "failed to listen on TCP %J (%m)\n",
 			laddr, err);
 		goto out;
 	}
 
-	DEBUG_PRINTF("ctrl_tcp: TCP socket listening on %J\n", laddr);
+	SLOG(SLOG_VILLA, SLOG_INFO, "TCP socket listening on %J\n", laddr);
+
+	if (str_isset(upath)) {
+#ifndef WIN32
+		err = unix_listen(st, upath, seqpacket);
+		if (err) {
+			SLOG(SLOG_VILLA, SLOG_WARN, "failed to listen on %s (%m)\n",
+				upath, err);
+			goto out;
+		}
+
+		SLOG(SLOG_VILLA, SLOG_INFO, "%s socket listening on %s\n",
+			seqpacket ? "SOCK_SEQPACKET" : "SOCK_STREAM", upath);
+#else
+		(void)seqpacket;
+		SLOG(SLOG_VILLA, SLOG_WARN, "unix domain sockets not supported\n");
+#endif
+	}
 
  out:
 	if (err)
@@ -252,41 +410,138 @@ static int ctrl_alloc(struct ctrl_st **stp, const struct sa *laddr)
 	return err;
 }
 
+/* the level of all subsystems and the entries buffered for the writer */
+static void log_config(void)
+{
+	char name[16];
+	uint32_t ring = 4096;
+
+	if (0 == conf_get_str(conf_cur(), "villa_log_level", name,
+		sizeof(name))) {
+		enum slog_level level;
+
+		if (slog_level_parse(&level, name)) {
+			SLOG(SLOG_VILLA, SLOG_WARN, "invalid villa_log_level %s\n", name);
+		}
+		else {
+			for (int i = 0; i < SLOG_SUBSYSTEMS; ++i)
+				slog_level_set((enum slog_sub)i, level);
+		}
+	}
+
+	(void)conf_get_u32(conf_cur(), "villa_log_ring", &ring);
+
+	int err = slog_init(ring);
+	if (err)
+		SLOG(SLOG_VILLA, SLOG_WARN, "logging synchronously (%m)\n", err);
+}
+
+/* safe to call after a partial module_init */
+static void teardown(void)
+{
+	uag_event_unregister(ua_event_handler);
+	cmd_unregister(baresip_commands(), cmdv);
+
+	ctrl = mem_deref(ctrl);
+
+	villa_metrics_close();
+	villa_io_close();
+	villa_preload_close();
+	timer_wheel_close();
+	slog_close();
+}
+
+
 static int module_init(void)
 {
 	struct sa laddr;
+	char upath[256] = "";
+	bool seqpacket = false;
+
+	log_config();
 
 	if (conf_get_sa(conf_cur(), "villa_tcp_listen", &laddr)) {
 		sa_set_str(&laddr, "0.0.0.0", CTRL_PORT);
 	}
 
-	int err = ctrl_alloc(&ctrl, &laddr);
+	/* optional unix domain socket for controllers on the same host */
+	(void)conf_get_str(conf_cur(), "villa_unix_listen", upath,
+		sizeof(upath));
+	(void)conf_get_bool(conf_cur(), "villa_unix_seqpacket", &seqpacket);
+
+	/* sessions survive a controller reconnect for the grace period */
+	uint32_t grace_period = 0;
+	uint32_t journal_size = 64;
+	uint32_t trace_size = 128;
+	(void)conf_get_u32(conf_cur(), "villa_grace_period", &grace_period);
+	(void)conf_get_u32(conf_cur(), "villa_journal_size", &journal_size);
+	(void)conf_get_u32(conf_cur(), "villa_trace_size", &trace_size);
+	villa_session_config(grace_period, journal_size, trace_size);
+
+	uint32_t priorities = 0;
+	if (0 == conf_get_u32(conf_cur(), "villa_priorities", &priorities))
+		villa_queue_config(priorities);
+
+	/* threads that open audio files off the main loop */
+	uint32_t io_threads = 2;
+	(void)conf_get_u32(conf_cur(), "villa_io_threads", &io_threads);
+
+	int err = villa_io_config(io_threads);
 	if (err)
-		return err;
+		goto out;
+
+	/* warm the page cache for the atoms that play next, in KB/s */
+	uint32_t prefetch_atoms = 2;
+	uint32_t prefetch_rate = 65536;
+	(void)conf_get_u32(conf_cur(), "villa_prefetch_atoms", &prefetch_atoms);
+	(void)conf_get_u32(conf_cur(), "villa_prefetch_rate", &prefetch_rate);
+	villa_prefetch_config(prefetch_atoms, prefetch_rate);
+
+	/* read the assets of the manifest on all cores before calls are
+	   taken */
+	char manifest[256] = "";
+	if (0 == conf_get_str(conf_cur(), "villa_preload", manifest,
+		sizeof(manifest)))
+		villa_preload_config(manifest);
+
+	err = ctrl_alloc(&ctrl, &laddr, upath, seqpacket);
+	if (err)
+		goto out;
+
+	villa_metrics_init();
+
+	/* optional HTTP listener for Prometheus */
+	struct sa maddr;
+	if (0 == conf_get_sa(conf_cur(), "villa_metrics_listen", &maddr)) {
+		err = villa_metrics_listen(&maddr);
+		if (err)
+			goto out;
+	}
 
 	err = uag_event_register(ua_event_handler, ctrl);
 	if (err)
-		return err;
+		goto out;
 
 	err = cmd_register(baresip_commands(), cmdv, ARRAY_SIZE(cmdv));
 	if (err)
-		return err;
+		goto out;
 
-	DEBUG_PRINTF("villa: module loaded\n");
+	SLOG(SLOG_VILLA, SLOG_INFO, "module loaded\n");
 
-	return 0;
+ out:
+	/* stop the threads and timers that were started */
+	if (err)
+		teardown();
+
+	return err;
 }
 
 
 static int module_close(void)
 {
-	DEBUG_PRINTF("villa: module closing..\n");
+	SLOG(SLOG_VILLA, SLOG_INFO, "module closing..\n");
 
-	uag_event_unregister(ua_event_handler);
-	cmd_unregister(baresip_commands(), cmdv);
-
-	// message_unlisten(baresip_message(), message_handler);
-	ctrl = mem_deref(ctrl);
+	teardown();
 
 	return 0;
 }